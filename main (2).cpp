@@ -1,539 +1,4998 @@
 
 #include <iostream>
+#include <map>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
+// Vectorized kernels for x86 processors, chosen at run time from the CPU
+// features. Other compilers and processors use the plain C++ kernels.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define X86_KERNELS 1
+#endif
 
-// Pixel structure
+// Instruction sets the vectorized kernels can use, from slowest to fastest
+enum SimdLevel
+{
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+/**
+ * Gets the fastest instruction set the vectorized kernels can use on this
+ * processor. It is detected once. Setting the IMGPROC_SIMD environment
+ * variable to none, sse2 or avx2 lowers it, to compare the kernels.
+ * @return the instruction set level
+ */
+SimdLevel simd_level()
+{
+    static const SimdLevel level = []()
+    {
+        SimdLevel detected = SIMD_NONE;
+#ifdef X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512bw"))
+        {
+            detected = SIMD_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            detected = SIMD_AVX2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            detected = SIMD_SSE2;
+        }
+#endif
+        const char* names[] = {"none", "sse2", "avx2", "avx512"};
+        const char* limit = getenv("IMGPROC_SIMD");
+        for (int i = 0; limit != nullptr && i < 4; i++)
+        {
+            if (string(limit) == names[i] && i < detected)
+            {
+                detected = (SimdLevel)i;
+            }
+        }
+        return detected;
+    }();
+    return level;
+}
+
+// Number of heap allocations, and their bytes, since the program started.
+// Both operator new and image buffers are counted, for the benchmarks.
+atomic<long> allocation_count{0};
+atomic<long> allocation_bytes{0};
+
+// Work done by one thread, for the statistics of the stages it runs. Work
+// the thread pool does for the thread is added to it as well.
+struct ThreadCounters
+{
+    long allocations = 0;
+    long allocated_bytes = 0;
+    // Bytes of image files read and written
+    long bytes_read = 0;
+    long bytes_written = 0;
+    // Major page faults of the bands the pool workers ran for the thread.
+    // Its own faults are counted by the kernel, see thread_major_faults().
+    long major_faults = 0;
+};
+thread_local ThreadCounters thread_counters;
+
+/**
+ * Gets the number of major page faults of the calling thread, pages it
+ * touched that had to be read from disk
+ * @return the number of faults since the thread started
+ */
+long thread_major_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_majflt;
+}
+
+/**
+ * Counts one heap allocation
+ * @param bytes size of the allocation
+ */
+void count_allocation(size_t bytes)
+{
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    allocation_bytes.fetch_add(bytes, memory_order_relaxed);
+    thread_counters.allocations++;
+    thread_counters.allocated_bytes += bytes;
+}
+
+// Counting replacements of the global allocation functions. The array and
+// nothrow forms call these by default. They are kept out of line, otherwise
+// the compiler warns about the free in operator delete once it is inlined.
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    count_allocation(size);
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+
+// Pixel structure, stored in the same blue, green, red order as BMP files
 struct Pixel
 {
-    // Red, green, blue color values
-    int red;
-    int green;
-    int blue;
+    // Blue, green, red color values
+    unsigned char blue;
+    unsigned char green;
+    unsigned char red;
+};
+static_assert(sizeof(Pixel) == 3, "Pixel must be exactly three bytes");
+
+// Pixel of a 32-bit image, in the blue, green, red, alpha order of BMP files
+struct PixelBGRA
+{
+    unsigned char blue;
+    unsigned char green;
+    unsigned char red;
+    // Opacity, 255 for opaque
+    unsigned char alpha;
+};
+static_assert(sizeof(PixelBGRA) == 4, "PixelBGRA must be exactly four bytes");
+
+/**
+ * Copies the alpha value of a pixel, for kernels written for both pixel
+ * types. Pixels without an alpha channel have nothing to copy.
+ * @param in  the input pixel
+ * @param out the output pixel
+ */
+inline void copy_alpha(const Pixel&, Pixel&) {}
+inline void copy_alpha(const PixelBGRA& in, PixelBGRA& out) { out.alpha = in.alpha; }
+
+// Alignment in bytes of image buffers and of every row within them
+const int IMAGE_ALIGNMENT = 64;
+
+// Most bytes of free image buffers the buffer pool keeps for reuse
+const size_t BUFFER_POOL_BYTES = (size_t)256 << 20;
+
+// Pool of free image buffers, keyed by their size in bytes, which the
+// dimensions and channels of an image decide. Every effect makes a new
+// image, usually of the same size as its input, so a chain of effects or a
+// batch of same-sized files keeps getting back the same few buffers
+// instead of going to the allocator and faulting in fresh pages each time.
+// Buffers come back through the deleter of their shared_ptr, so they
+// return to the pool when the last image using them goes away.
+class BufferPool
+{
+public:
+    /**
+     * Gets an aligned buffer, recycled if the pool has one of this size.
+     * The contents are not initialized.
+     * @param size size of the buffer in bytes
+     * @return the buffer, which goes back to the pool once released
+     */
+    shared_ptr<unsigned char> get(size_t size)
+    {
+        unsigned char* buffer = nullptr;
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            auto found = free_buffers.find(size);
+            if (found != free_buffers.end() && !found->second.empty())
+            {
+                // The buffer freed last is the most likely to still be cached
+                buffer = found->second.back();
+                found->second.pop_back();
+                free_bytes -= size;
+            }
+        }
+        if (buffer == nullptr)
+        {
+            buffer = (unsigned char*)aligned_alloc(IMAGE_ALIGNMENT, size);
+            if (buffer == nullptr)
+            {
+                throw bad_alloc();
+            }
+            count_allocation(size);
+        }
+        return shared_ptr<unsigned char>(buffer, [this, size](unsigned char* released) { put(released, size); });
+    }
+
+private:
+    /**
+     * Takes a buffer back, or frees it if the pool is full
+     * @param buffer the released buffer
+     * @param size   size of the buffer in bytes
+     */
+    void put(unsigned char* buffer, size_t size)
+    {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            if (free_bytes + size <= BUFFER_POOL_BYTES)
+            {
+                free_buffers[size].push_back(buffer);
+                free_bytes += size;
+                return;
+            }
+        }
+        free(buffer);
+    }
+
+    mutex pool_mutex;
+    map<size_t, vector<unsigned char*>> free_buffers;
+    size_t free_bytes = 0;
+};
+
+/**
+ * Gets the buffer pool of all images. It is never destroyed, so that
+ * images released during exit can still return their buffers.
+ * @return the pool
+ */
+BufferPool& get_buffer_pool()
+{
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+// Image structure
+// All rows live in one contiguous, aligned 8-bit buffer. Row i starts at
+// pixels + i * stride, and the stride may be negative for images that are
+// read in place from a bottom-up BMP file. Copies of an image share the
+// same buffer, so copying an image never copies its pixels.
+// Images have three channels (Pixel) unless they were read from a 32-bit
+// file with its alpha channel kept, which gives four channels (PixelBGRA).
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    // Number of color values per pixel, 3 or 4
+    int channels = 3;
+    // Bytes from the start of one row to the start of the next one
+    long stride = 0;
+    // First byte of row 0 (the top row)
+    unsigned char* pixels = nullptr;
+    // Owner of the memory holding the pixels
+    shared_ptr<unsigned char> buffer;
+
+    Image() = default;
+
+    /**
+     * Makes an image of the given size, with a buffer from the buffer pool.
+     * The pixels are not initialized.
+     * @param width    width of the image in pixels
+     * @param height   height of the image in pixels
+     * @param channels number of color values per pixel, 3 or 4
+     */
+    Image(int width, int height, int channels = 3)
+    {
+        this->width = width;
+        this->height = height;
+        this->channels = channels;
+        stride = row_stride(width, channels);
+        buffer = get_buffer_pool().get(buffer_size(width, height, channels));
+        pixels = buffer.get();
+    }
+
+    /**
+     * Gets the bytes from one row to the next of an image, with the padding
+     * that keeps every row aligned
+     * @param width    width of the image in pixels
+     * @param channels number of color values per pixel, 3 or 4
+     * @return the stride in bytes
+     */
+    static long row_stride(int width, int channels = 3)
+    {
+        return ((long)width * channels + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+    }
+
+    /**
+     * Gets the size of the buffer of an image, padding included
+     * @param width    width of the image in pixels
+     * @param height   height of the image in pixels
+     * @param channels number of color values per pixel, 3 or 4
+     * @return the size in bytes
+     */
+    static size_t buffer_size(int width, int height, int channels = 3)
+    {
+        return max((size_t)row_stride(width, channels) * height, (size_t)IMAGE_ALIGNMENT);
+    }
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    // Pixels of the given row of a three channel image
+    Pixel* operator[](int row) { return (Pixel*)(pixels + row * stride); }
+    const Pixel* operator[](int row) const { return (const Pixel*)(pixels + row * stride); }
+
+    // Pixels of the given row of a four channel image
+    PixelBGRA* bgra(int row) { return (PixelBGRA*)(pixels + row * stride); }
+    const PixelBGRA* bgra(int row) const { return (const PixelBGRA*)(pixels + row * stride); }
+
+    // Pixels of the given row as either pixel type, for code written for both
+    template <typename P> P* row(int row) { return (P*)(pixels + row * stride); }
+    template <typename P> const P* row(int row) const { return (const P*)(pixels + row * stride); }
+
+    // Bytes of the given row
+    unsigned char* row_bytes(int row) { return pixels + row * stride; }
+    const unsigned char* row_bytes(int row) const { return pixels + row * stride; }
+};
+
+// Planar image structure
+// The same pixels as a three channel Image, but with one plane per channel
+// (blue, green, red) instead of interleaved pixels, so that vector code can
+// load many values of one channel at once without shuffling them apart.
+// The planes are stored one after the other in one aligned buffer, and
+// every row of every plane starts on an IMAGE_ALIGNMENT boundary.
+struct PlanarImage
+{
+    int width = 0;
+    int height = 0;
+    // Bytes from the start of one row of a plane to the start of the next one
+    long stride = 0;
+    // Owner of the memory holding the planes
+    shared_ptr<unsigned char> buffer;
+
+    PlanarImage() = default;
+
+    /**
+     * Makes a planar image of the given size, with a buffer from the buffer
+     * pool. The values are not initialized.
+     * @param width  width of the image in pixels
+     * @param height height of the image in pixels
+     */
+    PlanarImage(int width, int height)
+    {
+        this->width = width;
+        this->height = height;
+        stride = ((long)width + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+        size_t size = max((size_t)stride * height * 3, (size_t)IMAGE_ALIGNMENT);
+        buffer = get_buffer_pool().get(size);
+    }
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    // Values of one channel (0 blue, 1 green, 2 red) in the given row
+    unsigned char* plane(int channel, int row) { return buffer.get() + ((long)channel * height + row) * stride; }
+    const unsigned char* plane(int channel, int row) const { return buffer.get() + ((long)channel * height + row) * stride; }
 };
 
 /**
- * Gets an integer from a binary stream.
+ * Gets a little-endian integer from a byte buffer.
  * Helper function for read_image()
- * @param stream the stream
+ * @param buffer the bytes read from the file
  * @param offset the offset at which to read the integer
  * @param bytes  the number of bytes to read
  * @return the integer starting at the given offset
  */ 
-int get_int(fstream& stream, int offset, int bytes)
+int get_int(const unsigned char buffer[], int offset, int bytes)
 {
-    stream.seekg(offset);
-    int result = 0;
-    int base = 1;
+    // Unsigned, so that four byte values such as the negative height of a
+    // top-down file come out as the same bits without overflowing
+    unsigned int result = 0;
+    unsigned int base = 1;
     for (int i = 0; i < bytes; i++)
     {   
-        result = result + stream.get() * base;
+        result = result + buffer[offset + i] * base;
         base = base * 256;
     }
-    return result;
+    return (int)result;
+}
+
+// Layout of the pixels of a BMP file
+struct BmpInfo
+{
+    // Offset of the pixel array in the file
+    int start = 0;
+    int width = 0;
+    int height = 0;
+    int bytes_per_pixel = 0;
+    // Bytes per scanline, including the padding
+    int row_bytes = 0;
+    // Whether the rows are stored from top to bottom
+    bool top_down = false;
+
+    // Offset in the file of the given row of the image
+    off_t row_offset(int row) const
+    {
+        return start + (off_t)(top_down ? row : height - 1 - row) * row_bytes;
+    }
+};
+
+// Compression methods of the DIB header
+const int BI_RGB = 0;
+const int BI_BITFIELDS = 3;
+const int BI_ALPHABITFIELDS = 6;
+// Size of the BMP header and the 40 byte DIB header
+const int BMP_HEADER_BYTES = 54;
+// End of the channel masks of BI_BITFIELDS files, which follow a 40 byte
+// DIB header or are part of a larger one
+const int BMP_MASKS_END = 70;
+
+/**
+ * Gets the layout of the pixels from the headers of a BMP file.
+ * The sizes are computed in 64 bits, so that a crafted width or height
+ * cannot wrap them around, and the pixel array must end where the file
+ * size in the header says the file ends. Only uncompressed pixels are
+ * read, and BI_BITFIELDS files only if their masks give the blue, green,
+ * red, alpha order of uncompressed 32-bit pixels.
+ * @param header the first bytes of the file, up to BMP_MASKS_END
+ * @param size   the number of bytes in the header, at least BMP_HEADER_BYTES
+ * @param info   the layout of the pixels
+ * @return true if the headers describe a valid image
+ */
+bool parse_bmp_header(const unsigned char header[], size_t size, BmpInfo& info)
+{
+    // The file size and offset are unsigned, and files over 2 GB are valid
+    uint64_t file_size = (unsigned int)get_int(header, 2, 4);
+    uint64_t start = (unsigned int)get_int(header, 10, 4);
+    int64_t width = get_int(header, 18, 4);
+    int64_t height = get_int(header, 22, 4);
+    int bytes_per_pixel = get_int(header, 28, 2) / 8;
+    // A negative height means the rows are stored from top to bottom
+    bool top_down = height < 0;
+    height = top_down ? -height : height;
+    if (width <= 0 || height == 0 || bytes_per_pixel < 3 || start > INT_MAX)
+    {
+        return false;
+    }
+
+    // Channel masks in any other order would swap the channels
+    int compression = get_int(header, 30, 4);
+    if (compression == BI_BITFIELDS || compression == BI_ALPHABITFIELDS)
+    {
+        if (bytes_per_pixel != 4 || size < BMP_MASKS_END)
+        {
+            return false;
+        }
+        // Files with a 40 byte DIB header have an alpha mask only for BI_ALPHABITFIELDS
+        bool alpha_mask = compression == BI_ALPHABITFIELDS || get_int(header, 14, 4) >= 56;
+        unsigned int alpha = alpha_mask ? get_int(header, 66, 4) : 0;
+        if (get_int(header, 54, 4) != 0x00FF0000 || get_int(header, 58, 4) != 0x0000FF00
+            || get_int(header, 62, 4) != 0x000000FF || (alpha != 0 && alpha != 0xFF000000))
+        {
+            return false;
+        }
+    }
+    else if (compression != BI_RGB)
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    uint64_t row_bytes = ((uint64_t)width * bytes_per_pixel + 3) / 4 * 4;
+    // A row larger than the file cannot be valid, and checking that first
+    // keeps the size of the pixel array within 64 bits
+    if (row_bytes > file_size || row_bytes > INT_MAX || file_size != start + row_bytes * height)
+    {
+        return false;
+    }
+
+    info.start = start;
+    info.width = width;
+    info.height = height;
+    info.bytes_per_pixel = bytes_per_pixel;
+    info.row_bytes = row_bytes;
+    info.top_down = top_down;
+    return true;
+}
+
+// Largest number of bytes read from the file at once while decoding
+const int READ_BLOCK_BYTES = 4 << 20;
+
+/**
+ * Reads the BMP image specified and returns the resulting image
+ * The header is read once, then the pixel array is read in large blocks of
+ * whole scanlines and unpacked from memory. Both bottom-up and top-down
+ * (negative height) files are read.
+ * @param filename   BMP image filename
+ * @param keep_alpha whether a 32-bit file gives a four channel image with
+ *                   its alpha channel, instead of a three channel image
+ * @return the image, empty if the file is not a valid image
+ */
+Image read_image(string filename, bool keep_alpha = false)
+{
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return {};
+    }
+
+    // Read the BMP header, the start of the DIB header and any channel
+    // masks in one go
+    unsigned char header[BMP_MASKS_END] = {0};
+    stream.read((char*)header, BMP_MASKS_END);
+    size_t header_size = stream.gcount();
+    thread_counters.bytes_read += header_size;
+    stream.clear();
+
+    // Get the image properties, and return an empty image if this is not
+    // a valid image
+    BmpInfo info;
+    if (header_size < BMP_HEADER_BYTES || !parse_bmp_header(header, header_size, info))
+    {
+        return {};
+    }
+    int width = info.width;
+    int height = info.height;
+    int bytes_per_pixel = info.bytes_per_pixel;
+    int row_bytes = info.row_bytes;
+    bool top_down = info.top_down;
+
+    // Create an image the size of the input image, with an alpha channel
+    // only if the file has one and it should be kept
+    int channels = keep_alpha && bytes_per_pixel == 4 ? 4 : 3;
+    Image image(width, height, channels);
+
+    // Read as many whole scanlines at a time as fit in one block
+    int rows_per_block = max(1, READ_BLOCK_BYTES / max(row_bytes, 1));
+    vector<unsigned char> block((size_t)min(rows_per_block, height) * row_bytes);
+    stream.seekg(info.start);
+
+    // For each row, in the order they are stored in the file
+    // Note: BMP files store pixels from bottom to top, unless they are top-down
+    int file_row = 0;
+    while (file_row < height)
+    {
+        int rows = min(rows_per_block, height - file_row);
+        if (!stream.read((char*)block.data(), (streamsize)rows * row_bytes))
+        {
+            return {};
+        }
+        thread_counters.bytes_read += (long)rows * row_bytes;
+        for (int r = 0; r < rows; r++, file_row++)
+        {
+            int i = top_down ? file_row : height - 1 - file_row;
+            const unsigned char* pos = block.data() + (size_t)r * row_bytes;
+            // Rows stored with as many channels as ours are copied as they are,
+            // minus the padding
+            if (bytes_per_pixel == channels)
+            {
+                memcpy(image.row_bytes(i), pos, (size_t)width * channels);
+                continue;
+            }
+            // Otherwise keep the blue, green, red values of each pixel
+            // Note: we are ignoring the alpha channel if there is one
+            Pixel* row = image[i];
+            for (int j = 0; j < width; j++)
+            {
+                row[j].blue = pos[0];
+                row[j].green = pos[1];
+                row[j].red = pos[2];
+                pos = pos + bytes_per_pixel;
+            }
+        }
+    }
+
+    // Close the stream and return the image
+    stream.close();
+    return image;
+}
+
+/**
+ * Memory-mapped read mode for BMP images. Maps the file specified and
+ * returns an image whose pixels are read in place from the file, without
+ * copying them. The image uses a negative stride because BMP files store
+ * rows from bottom to top, or a positive one for top-down files, and the
+ * stride covers the row padding.
+ * The mapping is private, so writing to the image never changes the file.
+ * Files that are not 24-bit are read with read_image() instead.
+ * @param filename BMP image filename
+ * @return the mapped image, empty if the file is not a valid image
+ */
+Image map_image(string filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return {};
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < BMP_HEADER_BYTES)
+    {
+        close(fd);
+        return {};
+    }
+    size_t mapping_size = info.st_size;
+    void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the file is closed
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return {};
+    }
+    shared_ptr<unsigned char> buffer((unsigned char*)mapping,
+        [mapping_size](unsigned char* bytes) { munmap(bytes, mapping_size); });
+
+    // Get the image properties, and return an empty image if this is not
+    // a valid image
+    const unsigned char* bytes = buffer.get();
+    BmpInfo bmp;
+    if (!parse_bmp_header(bytes, min(mapping_size, (size_t)BMP_MASKS_END), bmp))
+    {
+        return {};
+    }
+    if (get_int(bytes, 28, 2) != 24)
+    {
+        return read_image(filename);
+    }
+    // The pixel array must lie within the mapping
+    if ((uint64_t)bmp.start + (uint64_t)bmp.row_bytes * bmp.height > mapping_size)
+    {
+        return {};
+    }
+
+    // The whole pixel array is about to be read
+    madvise(mapping, mapping_size, MADV_WILLNEED);
+    // The pages are read from the file as they are touched, but the whole
+    // file counts as read here
+    thread_counters.bytes_read += mapping_size;
+
+    Image image;
+    image.width = bmp.width;
+    image.height = bmp.height;
+    image.stride = bmp.top_down ? bmp.row_bytes : -(long)bmp.row_bytes;
+    image.pixels = buffer.get() + bmp.row_offset(0);
+    image.buffer = buffer;
+    return image;
+}
+
+/**
+ * Touches every page of the pixels of an image, so that the pages of a
+ * mapped file are read from disk now rather than by the first effect
+ * @param image the image
+ */
+void fault_in(const Image& image)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    long row_bytes = (long)image.width * image.channels;
+    volatile unsigned char sink = 0;
+    for (int row = 0; row < image.height; row++)
+    {
+        const unsigned char* bytes = image.row_bytes(row);
+        for (long i = 0; i < row_bytes; i += page_size)
+        {
+            sink = bytes[i];
+        }
+        sink = bytes[row_bytes - 1];
+    }
+    (void)sink;
+}
+
+/**
+ * Sets a value to the char array starting at the offset using the size
+ * specified by the bytes.
+ * This is a helper function for write_image()
+ * @param arr    Array to set values for
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to set
+ * @param value  Value to set
+ * @return nothing
+ */
+void set_bytes(unsigned char arr[], int offset, int bytes, long value)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        arr[offset+i] = (unsigned char)(value>>(i*8));
+    }
+}
+
+/**
+ * Reads bytes from a given offset of a file descriptor, without moving its
+ * file offset, until the count is reached
+ * @param fd     The file descriptor to read from
+ * @param bytes  The buffer to read into
+ * @param count  Number of bytes to read
+ * @param offset Offset in the file of the first byte
+ * @return True if all the bytes were read and false otherwise
+ */
+bool read_all(int fd, unsigned char bytes[], size_t count, off_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t done = pread(fd, bytes, count, offset);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        thread_counters.bytes_read += done;
+        bytes = bytes + done;
+        count = count - done;
+        offset = offset + done;
+    }
+    return true;
+}
+
+// Largest number of bytes handed to the file in one write while encoding
+const int WRITE_BLOCK_BYTES = 4 << 20;
+
+/**
+ * Writes all the bytes of a buffer to a file descriptor
+ * Helper function for write_image()
+ * @param fd    The file descriptor to write to
+ * @param bytes The bytes to write
+ * @param count Number of bytes to write
+ * @return True if successful and false otherwise
+ */
+bool write_all(int fd, const unsigned char bytes[], size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t written = write(fd, bytes, count);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        thread_counters.bytes_written += written;
+        bytes = bytes + written;
+        count = count - written;
+    }
+    return true;
+}
+
+/**
+ * Writes all the bytes of a buffer at a given offset of a file descriptor,
+ * without moving its file offset
+ * @param fd     The file descriptor to write to
+ * @param bytes  The bytes to write
+ * @param count  Number of bytes to write
+ * @param offset Offset in the file of the first byte
+ * @return True if successful and false otherwise
+ */
+bool write_all(int fd, const unsigned char bytes[], size_t count, off_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t written = pwrite(fd, bytes, count, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        thread_counters.bytes_written += written;
+        bytes = bytes + written;
+        count = count - written;
+        offset = offset + written;
+    }
+    return true;
+}
+
+// Size of the BMP header plus the DIB header of the 24-bit files written
+const int BMP_HEADERS_SIZE = 54;
+// Size of the BMP header plus the BITMAPV4HEADER of the 32-bit files
+// written, which holds the channel masks, alpha included
+const int BMP_V4_HEADERS_SIZE = 122;
+
+/**
+ * Gets the size of the headers of the files written
+ * @param channels 3 for a 24-bit file, 4 for a 32-bit file with alpha
+ * @return the size of the BMP and DIB headers in bytes
+ */
+int bmp_headers_size(int channels)
+{
+    return channels == 4 ? BMP_V4_HEADERS_SIZE : BMP_HEADERS_SIZE;
+}
+
+/**
+ * Fills in the BMP and DIB headers of a 24-bit or 32-bit BMP file. 32-bit
+ * files get a BITMAPV4HEADER with BI_BITFIELDS masks, so that readers
+ * know that the fourth byte of each pixel is alpha.
+ * Helper function for write_image()
+ * @param headers       the first bmp_headers_size(channels) bytes of the file
+ * @param width_pixels  width of the image in pixels
+ * @param height_pixels height of the image in pixels
+ * @param channels      3 for a 24-bit file, 4 for a 32-bit file with alpha
+ * @param top_down      whether the rows are stored from top to bottom
+ */
+void set_bmp_headers(unsigned char headers[], int width_pixels, int height_pixels, int channels, bool top_down)
+{
+    const int BMP_HEADER_SIZE = 14;
+    const int HEADER_SIZE = bmp_headers_size(channels);
+    const int DIB_HEADER_SIZE = HEADER_SIZE - BMP_HEADER_SIZE;
+    unsigned char* bmp_header = headers;
+    unsigned char* dib_header = headers + BMP_HEADER_SIZE;
+
+    // Pixel array size in bytes, including padding (4 byte alignment)
+    int width_bytes = width_pixels * channels + (4 - width_pixels * channels % 4) % 4;
+    long array_bytes = (long)width_bytes * height_pixels;
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, HEADER_SIZE+array_bytes); // Size of BMP file
+    set_bytes(bmp_header,  6, 2, 0);                // Reserved
+    set_bytes(bmp_header,  8, 2, 0);                // Reserved
+    set_bytes(bmp_header, 10, 4, HEADER_SIZE);      // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, top_down ? -height_pixels : height_pixels); // Height of bitmap in pixels, negative if top-down
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, channels * 8);     // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, channels == 4 ? BI_BITFIELDS : BI_RGB); // Compression method
+    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+    if (channels == 4)
+    {
+        set_bytes(dib_header, 40, 4, 0x00FF0000);   // Red channel mask
+        set_bytes(dib_header, 44, 4, 0x0000FF00);   // Green channel mask
+        set_bytes(dib_header, 48, 4, 0x000000FF);   // Blue channel mask
+        set_bytes(dib_header, 52, 4, 0xFF000000);   // Alpha channel mask
+        set_bytes(dib_header, 56, 4, 0x73524742);   // Color space ('sRGB')
+        memset(dib_header + 60, 0, 48);             // Endpoints and gamma, unused for sRGB
+    }
+}
+
+/**
+ * Write the input image as a BMP file to a file descriptor that is already
+ * open for writing. The headers and the scanlines are packed into large
+ * blocks, and each block is handed to the file in a single write.
+ * The file descriptor is left open. Three channel images are written as
+ * 24-bit files and four channel images as 32-bit files with alpha.
+ * @param fd       The file descriptor to save the image to
+ * @param image    The input image to save
+ * @param top_down Whether to store the rows from top to bottom, with a
+ *                 negative height, instead of from bottom to top
+ * @return True if successful and false otherwise
+ */
+bool write_image(int fd, const Image& image, bool top_down = false)
+{
+    // Nothing to write for an empty image
+    if (image.empty())
+    {
+        return false;
+    }
+
+    // Get the image width and height in pixels
+    int width_pixels = image.width;
+    int height_pixels = image.height;
+
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    int width_bytes = width_pixels * image.channels;
+    int padding_bytes = 0;
+    padding_bytes = (4 - width_bytes % 4) % 4;
+    int scanline_bytes = width_bytes;
+    width_bytes = width_bytes + padding_bytes;
+
+    // Create the BMP and DIB Headers
+    int headers_size = bmp_headers_size(image.channels);
+    int rows_per_block = max(1, (WRITE_BLOCK_BYTES - headers_size) / width_bytes);
+    vector<unsigned char> block(headers_size + (size_t)min(rows_per_block, height_pixels) * width_bytes);
+    set_bmp_headers(block.data(), width_pixels, height_pixels, image.channels, top_down);
+
+    // Pixel Array (Left to right, bottom to top unless top-down, with padding)
+    // The headers go out with the first block of scanlines
+    size_t header_bytes = headers_size;
+    int file_row = 0;
+    while (file_row < height_pixels)
+    {
+        int rows = min(rows_per_block, height_pixels - file_row);
+        unsigned char* pos = block.data() + header_bytes;
+        for (int r = 0; r < rows; r++, file_row++)
+        {
+            int h = top_down ? file_row : height_pixels - 1 - file_row;
+            // Our rows hold the pixels in the same blue, green, red (alpha) order
+            memcpy(pos, image.row_bytes(h), scanline_bytes);
+            memset(pos + scanline_bytes, 0, padding_bytes);
+            pos = pos + width_bytes;
+        }
+        if (!write_all(fd, block.data(), pos - block.data()))
+        {
+            return false;
+        }
+        header_bytes = 0;
+    }
+    return true;
+}
+
+/**
+ * Opens a new temporary file next to an output file. The output is written
+ * to the temporary file and renamed over the output file once it is
+ * complete, so that an output file that is also the input file is not
+ * truncated while it is still being read, or mapped.
+ * @param filename The output file name
+ * @param temp     Set to the name of the temporary file
+ * @param flags    The access mode to open the temporary file with
+ * @return The file descriptor of the temporary file, negative on failure
+ */
+int open_output(string filename, string& temp, int flags)
+{
+    // Unique among the threads of this process and among processes
+    static atomic<long> next_temp{0};
+    temp = filename + ".tmp" + to_string(getpid()) + "." + to_string(next_temp++);
+    return open(temp.c_str(), flags | O_CREAT | O_EXCL, 0644);
+}
+
+/**
+ * Closes a file opened with open_output(), and renames it over the output
+ * file if everything was written, or removes it otherwise
+ * @param fd       The file descriptor of the temporary file
+ * @param temp     The name of the temporary file
+ * @param filename The output file name
+ * @param success  Whether everything was written
+ * @return True if the output file was replaced and false otherwise
+ */
+bool finish_output(int fd, string temp, string filename, bool success)
+{
+    success = close(fd) == 0 && success;
+    if (success && rename(temp.c_str(), filename.c_str()) == 0)
+    {
+        return true;
+    }
+    unlink(temp.c_str());
+    return false;
+}
+
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param top_down Whether to store the rows from top to bottom
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const Image& image, bool top_down = false)
+{
+    // Open a temporary file for writing, which replaces any existing file
+    // once it is complete
+    string temp;
+    int fd = open_output(filename, temp, O_WRONLY);
+
+    // If there was a problem opening the file, return false
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool success = write_image(fd, image, top_down);
+
+    // Close the file and report whether everything was written
+    return finish_output(fd, temp, filename, success);
+}
+
+// Fixed-size pool of worker threads that run the row bands of an effect.
+// A call to run_bands() splits the rows into bands that the calling thread
+// and the workers take in turn. Every row is computed the same way no
+// matter which thread runs it, so the output does not depend on the number
+// of threads. The calling thread keeps taking bands until none are left,
+// so calls from several threads at once, or from inside a band, never wait
+// on a worker that is busy elsewhere.
+class ThreadPool
+{
+public:
+    /**
+     * Starts the worker threads
+     * @param threads total number of threads, including the calling thread
+     */
+    explicit ThreadPool(int threads)
+    {
+        this->threads = max(1, threads);
+        for (int i = 1; i < this->threads; i++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(tasks_mutex);
+            stopping = true;
+        }
+        tasks_ready.notify_all();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    int size() const { return threads; }
+
+    /**
+     * Runs a task on every band of rows and waits until all of them are done
+     * @param bands number of bands to split the rows into
+     * @param rows  number of rows
+     * @param task  the task, called with the first row and the row after the last
+     */
+    void run_bands(int bands, int rows, const function<void(int, int)>& task)
+    {
+        // Shared with the workers, which may look at it after this call returns
+        struct Job
+        {
+            atomic<int> next_band{0};
+            int bands = 0;
+            int rows = 0;
+            const function<void(int, int)>* task = nullptr;
+            mutex done_mutex;
+            condition_variable all_done;
+            int finished = 0;
+            // Work of the bands the workers ran, added to the calling thread's counters
+            long allocations = 0;
+            long allocated_bytes = 0;
+            long bytes_read = 0;
+            long bytes_written = 0;
+            long major_faults = 0;
+        };
+        auto job = make_shared<Job>();
+        job->bands = bands;
+        job->rows = rows;
+        job->task = &task;
+
+        auto take_bands = [job](bool worker)
+        {
+            ThreadCounters counters = thread_counters;
+            long major_faults = worker ? thread_major_faults() : 0;
+            int done = 0;
+            for (int band = job->next_band++; band < job->bands; band = job->next_band++)
+            {
+                (*job->task)((long)band * job->rows / job->bands, (long)(band + 1) * job->rows / job->bands);
+                done++;
+            }
+            if (done > 0)
+            {
+                lock_guard<mutex> lock(job->done_mutex);
+                if (worker)
+                {
+                    job->allocations += thread_counters.allocations - counters.allocations;
+                    job->allocated_bytes += thread_counters.allocated_bytes - counters.allocated_bytes;
+                    job->bytes_read += thread_counters.bytes_read - counters.bytes_read;
+                    job->bytes_written += thread_counters.bytes_written - counters.bytes_written;
+                    job->major_faults += thread_major_faults() - major_faults;
+                }
+                job->finished += done;
+                if (job->finished == job->bands)
+                {
+                    job->all_done.notify_all();
+                }
+            }
+        };
+
+        {
+            lock_guard<mutex> lock(tasks_mutex);
+            for (int i = 1; i < min(bands, threads); i++)
+            {
+                tasks.push_back([take_bands]() { take_bands(true); });
+            }
+        }
+        tasks_ready.notify_all();
+        take_bands(false);
+
+        unique_lock<mutex> lock(job->done_mutex);
+        job->all_done.wait(lock, [&job]() { return job->finished == job->bands; });
+        thread_counters.allocations += job->allocations;
+        thread_counters.allocated_bytes += job->allocated_bytes;
+        thread_counters.bytes_read += job->bytes_read;
+        thread_counters.bytes_written += job->bytes_written;
+        thread_counters.major_faults += job->major_faults;
+    }
+
+private:
+    // Worker thread loop, runs queued tasks until the pool is destroyed
+    void work()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(tasks_mutex);
+                tasks_ready.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    int threads = 1;
+    vector<thread> workers;
+    mutex tasks_mutex;
+    condition_variable tasks_ready;
+    deque<function<void()>> tasks;
+    bool stopping = false;
+};
+
+// Pool shared by all the effects, and the lock guarding it
+shared_ptr<ThreadPool> shared_pool;
+mutex shared_pool_mutex;
+
+/**
+ * Sets the number of threads the effects run on
+ * @param threads number of threads, 0 for one per processor core
+ */
+void set_thread_count(int threads)
+{
+    if (threads <= 0)
+    {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    lock_guard<mutex> lock(shared_pool_mutex);
+    if (shared_pool == nullptr || shared_pool->size() != threads)
+    {
+        shared_pool = make_shared<ThreadPool>(threads);
+    }
+}
+
+/**
+ * Gets the pool the effects run on. It is started on first use, with the
+ * number of threads in the IMGPROC_THREADS environment variable, or one
+ * per processor core if it is not set.
+ * @return the thread pool
+ */
+shared_ptr<ThreadPool> get_thread_pool()
+{
+    {
+        lock_guard<mutex> lock(shared_pool_mutex);
+        if (shared_pool != nullptr)
+        {
+            return shared_pool;
+        }
+    }
+    const char* threads = getenv("IMGPROC_THREADS");
+    set_thread_count(threads != nullptr ? atoi(threads) : 0);
+    lock_guard<mutex> lock(shared_pool_mutex);
+    return shared_pool;
+}
+
+// Fewest pixels worth handing to another thread as one band
+const int MIN_BAND_PIXELS = 1 << 16;
+
+/**
+ * Runs a task over the rows of an image in bands on the shared thread
+ * pool. Small images run on the calling thread only.
+ * @param rows       number of rows
+ * @param row_pixels number of pixels in each row, to size the bands
+ * @param task       the task, called with the first row and the row after the last
+ */
+void parallel_rows(int rows, int row_pixels, const function<void(int, int)>& task)
+{
+    shared_ptr<ThreadPool> pool = get_thread_pool();
+    long pixels = (long)rows * max(row_pixels, 1);
+    // A few bands per thread even out the bands that take longer
+    int bands = (int)min<long>({(long)rows, (long)pool->size() * 4, pixels / MIN_BAND_PIXELS});
+    if (bands <= 1 || pool->size() == 1)
+    {
+        task(0, rows);
+        return;
+    }
+    pool->run_bands(bands, rows, task);
+}
+
+/**
+ * Applies a row kernel to every row of an image on the shared thread pool.
+ * The kernel is called with the rows of the input and output images, as
+ * Pixel or PixelBGRA pointers to match the number of channels, and the
+ * index of the row.
+ * @param image  the input image
+ * @param kernel the row kernel
+ * @return the new image, the same size as the input
+ */
+template <typename Kernel>
+Image transform_rows(const Image& image, const Kernel& kernel)
+{
+    Image new_image(image.width, image.height, image.channels);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            if (image.channels == 4)
+            {
+                kernel(image.bgra(row), new_image.bgra(row), row);
+            }
+            else
+            {
+                kernel(image[row], new_image[row], row);
+            }
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Computes the vignette scaling factor of one pixel
+ * @param height       height of the image in pixels
+ * @param distance_col number of columns from the pixel to the center
+ * @param distance_row number of rows from the pixel to the center
+ * @return the scaling factor of the pixel
+ */
+double vignette_factor(int height, int distance_col, int distance_row)
+{
+    //find the distance from the cell to the center and calculate scaling factor
+    double distance = sqrt(pow(distance_col,2) + pow(distance_row,2));
+    return (height - distance)/height;
+}
+
+/**
+ * Computes the vignette scaling factors of one row, for images processed a
+ * few rows at a time or too large to keep their VignetteMap
+ * @param width   width of the image in pixels
+ * @param height  height of the image in pixels
+ * @param row     index of the row in the image
+ * @param factors the scaling factor of every pixel in the row
+ */
+void vignette_factors(int width, int height, int row, double* factors)
+{
+    int distance_row = abs(row - height/2);
+    for (int col = 0; col < width; col++)
+    {
+        factors[col] = vignette_factor(height, col - width/2, distance_row);
+    }
+}
+
+// Vignette scaling factors for one image size
+struct VignetteMap
+{
+    int width = 0;
+    int height = 0;
+    // Row d, column c holds the scaling factor of the pixels that are d rows
+    // and c columns away from the center pixel. The falloff is the same on
+    // both sides of the center, across and down, so only a quarter of the
+    // image is stored. Empty for images too large to keep the factors of,
+    // whose factors are computed row by row instead.
+    int columns = 0;
+    vector<double> factors;
+
+    // Scaling factors for the given row of the image, in a buffer of the
+    // calling thread that stays valid until its next call
+    const double* row_factors(int row) const
+    {
+        thread_local vector<double> unfolded;
+        unfolded.resize(width);
+        if (factors.empty())
+        {
+            vignette_factors(width, height, row, unfolded.data());
+            return unfolded.data();
+        }
+        const double* distances = factors.data() + (size_t)abs(row - height/2) * columns;
+        for (int col = 0; col < width; col++)
+        {
+            unfolded[col] = distances[abs(col - width/2)];
+        }
+        return unfolded.data();
+    }
+
+    size_t bytes() const { return factors.size() * sizeof(double); }
+};
+
+// Largest number of bytes of vignette maps kept in the cache. The factors
+// of images whose map would be larger are computed row by row instead.
+const size_t VIGNETTE_CACHE_BYTES = 16 << 20;
+
+/**
+ * Gets the vignette scaling factors for an image size. They only depend on
+ * the size, so they are computed the first time and then served from a
+ * small cache of the most recently used sizes.
+ * @param width  width of the image in pixels
+ * @param height height of the image in pixels
+ * @return the scaling factors for every pixel of an image of this size
+ */
+shared_ptr<const VignetteMap> get_vignette_map(int width, int height)
+{
+    static mutex cache_mutex;
+    // Most recently used map last
+    static vector<shared_ptr<const VignetteMap>> cache;
+    static size_t cached_bytes = 0;
+
+    lock_guard<mutex> lock(cache_mutex);
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+        if (cache[i]->width == width && cache[i]->height == height)
+        {
+            shared_ptr<const VignetteMap> found = cache[i];
+            cache.erase(cache.begin() + i);
+            cache.push_back(found);
+            return found;
+        }
+    }
+
+    auto map = make_shared<VignetteMap>();
+    map->width = width;
+    map->height = height;
+    map->columns = width/2 + 1;
+    size_t size = (size_t)(height/2 + 1) * map->columns;
+    if (size * sizeof(double) > VIGNETTE_CACHE_BYTES)
+    {
+        return map;
+    }
+    map->factors.resize(size);
+    for (int distance_row = 0; distance_row <= height/2; distance_row++)
+    {
+        double* factors = map->factors.data() + (size_t)distance_row * map->columns;
+        for (int distance_col = 0; distance_col < map->columns; distance_col++)
+        {
+            factors[distance_col] = vignette_factor(height, distance_col, distance_row);
+        }
+    }
+    cache.push_back(map);
+    cached_bytes += map->bytes();
+    while (cached_bytes > VIGNETTE_CACHE_BYTES)
+    {
+        cached_bytes -= cache.front()->bytes();
+        cache.erase(cache.begin());
+    }
+    return map;
+}
+
+#ifdef X86_KERNELS
+/**
+ * AVX2 version of vignette_row(), scales four pixels (twelve color values)
+ * at a time in double precision so the results match the plain version
+ * @param in      pixels of the input row
+ * @param out     pixels of the output row
+ * @param width   number of pixels in the row
+ * @param factors scaling factor of every pixel in the row
+ * @return the number of pixels done, the caller finishes the rest
+ */
+__attribute__((target("avx2")))
+int vignette_row_avx2(const Pixel* in, Pixel* out, int width, const double* factors)
+{
+    const unsigned char* in_bytes = (const unsigned char*)in;
+    unsigned char* out_bytes = (unsigned char*)out;
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    int col = 0;
+    for (; col + 4 <= width; col += 4)
+    {
+        // Spread the four factors over the twelve color values
+        __m256d f = _mm256_loadu_pd(factors + col);
+        __m256d f0 = _mm256_permute4x64_pd(f, _MM_SHUFFLE(1, 0, 0, 0));
+        __m256d f1 = _mm256_permute4x64_pd(f, _MM_SHUFFLE(2, 2, 1, 1));
+        __m256d f2 = _mm256_permute4x64_pd(f, _MM_SHUFFLE(3, 3, 3, 2));
+
+        int bytes[3];
+        memcpy(bytes, in_bytes + col * 3, 12);
+        __m128i r0 = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes[0]))), f0));
+        __m128i r1 = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes[1]))), f1));
+        __m128i r2 = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes[2]))), f2));
+
+        // Keep the low byte of each result, like storing an int in an unsigned char
+        __m128i words = _mm_packus_epi32(_mm_and_si128(r0, low_byte), _mm_and_si128(r1, low_byte));
+        __m128i packed = _mm_packus_epi16(words, _mm_packus_epi32(_mm_and_si128(r2, low_byte), _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i*)(out_bytes + col * 3), packed);
+        int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        memcpy(out_bytes + col * 3 + 8, &last, 4);
+    }
+    return col;
+}
+#endif
+
+#ifdef X86_KERNELS
+/**
+ * AVX2 version of vignette_row() for four channel pixels. Each pixel is one
+ * vector of four doubles, scaled by its factor except for the alpha value,
+ * which is multiplied by one and so stays the same.
+ * @param in      pixels of the input row
+ * @param out     pixels of the output row
+ * @param width   number of pixels in the row
+ * @param factors scaling factor of every pixel in the row
+ * @return the number of pixels done, the caller finishes the rest
+ */
+__attribute__((target("avx2")))
+int vignette_row_bgra_avx2(const PixelBGRA* in, PixelBGRA* out, int width, const double* factors)
+{
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    for (int col = 0; col < width; col++)
+    {
+        int bytes;
+        memcpy(&bytes, in + col, 4);
+        __m256d values = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+        __m256d f = _mm256_set_pd(1.0, factors[col], factors[col], factors[col]);
+        // Keep the low byte of each result, like storing an int in an unsigned char
+        __m128i scaled = _mm_and_si128(_mm256_cvttpd_epi32(_mm256_mul_pd(values, f)), low_byte);
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(scaled, scaled), scaled);
+        bytes = _mm_cvtsi128_si32(packed);
+        memcpy(out + col, &bytes, 4);
+    }
+    return width;
+}
+#endif
+
+/**
+ * Scales the color values of some pixels of a row by their vignette
+ * scaling factors, keeping any alpha value
+ * Helper function for vignette_row()
+ * @param in      pixels of the input row
+ * @param out     pixels of the output row
+ * @param first   index of the first pixel to scale
+ * @param last    index after the last pixel to scale
+ * @param factors scaling factor of every pixel in the row
+ */
+template <typename P>
+void vignette_pixels(const P* in, P* out, int first, int last, const double* factors)
+{
+    for (int col = first; col < last; col++)
+    {
+        double scaling_factor = factors[col];
+        out[col].red = (int)(in[col].red * scaling_factor);
+        out[col].green = (int)(in[col].green * scaling_factor);
+        out[col].blue = (int)(in[col].blue * scaling_factor);
+        copy_alpha(in[col], out[col]);
+    }
+}
+
+/**
+ * Scales every color value of a row by its vignette scaling factor
+ * Helper function for process_1()
+ * @param in      pixels of the input row
+ * @param out     pixels of the output row
+ * @param width   number of pixels in the row
+ * @param factors scaling factor of every pixel in the row
+ */
+void vignette_row(const Pixel* in, Pixel* out, int width, const double* factors)
+{
+    int col = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        col = vignette_row_avx2(in, out, width, factors);
+    }
+#endif
+    vignette_pixels(in, out, col, width, factors);
+}
+
+/**
+ * Scales every color value of a row of four channel pixels by its vignette
+ * scaling factor, keeping the alpha values
+ * @param in      pixels of the input row
+ * @param out     pixels of the output row
+ * @param width   number of pixels in the row
+ * @param factors scaling factor of every pixel in the row
+ */
+void vignette_row(const PixelBGRA* in, PixelBGRA* out, int width, const double* factors)
+{
+    int col = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        col = vignette_row_bgra_avx2(in, out, width, factors);
+    }
+#endif
+    vignette_pixels(in, out, col, width, factors);
+}
+
+// PROCESS 1 - Adds vignette effect - dark corners
+Image process_1(const Image& image)
+{
+    int num_rows = image.height; //Gets the number of rows (i.e. height) of the image
+    int num_columns = image.width; //Gets the number of columns (i.e. width) of the image
+    //The scaling factors only depend on the image size, so they are reused across calls
+    shared_ptr<const VignetteMap> map = get_vignette_map(num_columns, num_rows);
+    //The new image has the same rows and columns as the original image, and keeps any alpha channel
+    return transform_rows(image, [&](auto in, auto out, int row)
+    {
+        vignette_row(in, out, num_columns, map->row_factors(row));
+    });
+}
+// Lookup tables for a per-channel tone effect. Each channel has a table
+// with the output value for every possible 8-bit input value.
+struct ToneTable
+{
+    // Tables for the blue, green and red channels, in pixel order
+    unsigned char channel[3][256];
+};
+
+// Tone function used to fill a ToneTable
+typedef int (*ToneFunction)(int value, double scaling_factor);
+
+/**
+ * Lighten tone function, moves a color value towards 255
+ * @param value          the color value
+ * @param scaling_factor the scaling factor applied to the distance from 255
+ * @return the new color value
+ */
+int lighten_value(int value, double scaling_factor)
+{
+    return 255 - (255 - value) * scaling_factor;
+}
+
+/**
+ * Darken tone function, moves a color value towards 0
+ * @param value          the color value
+ * @param scaling_factor the scaling factor applied to the value
+ * @return the new color value
+ */
+int darken_value(int value, double scaling_factor)
+{
+    return value * scaling_factor;
+}
+
+/**
+ * Identity tone function, keeps a color value as it is. The scaling
+ * factor every tone function takes is not used.
+ * @param value the color value
+ * @return the same color value
+ */
+int same_value(int value, double)
+{
+    return value;
+}
+
+/**
+ * Builds the lookup tables of a tone effect by evaluating the tone
+ * function once for every 8-bit value of every channel
+ * @param tone           the tone function
+ * @param scaling_factor the scaling factor passed to the tone function
+ * @return the lookup tables
+ */
+ToneTable make_tone_table(ToneFunction tone, double scaling_factor)
+{
+    ToneTable table;
+    for (int value = 0; value < 256; value++)
+    {
+        // Storing the int in an unsigned char wraps it like write_image used to
+        unsigned char new_value = tone(value, scaling_factor);
+        table.channel[0][value] = new_value;
+        table.channel[1][value] = new_value;
+        table.channel[2][value] = new_value;
+    }
+    return table;
+}
+
+/**
+ * Applies a tone table to every pixel of a row, keeping any alpha value
+ * @param table the lookup tables of the tone effect
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row
+ * @param width number of pixels in the row
+ */
+template <typename P>
+void apply_tone_table(const ToneTable& table, const P* in, P* out, int width)
+{
+    for (int col = 0; col < width; col++)
+    {
+        out[col].blue = table.channel[0][in[col].blue];
+        out[col].green = table.channel[1][in[col].green];
+        out[col].red = table.channel[2][in[col].red];
+        copy_alpha(in[col], out[col]);
+    }
+}
+
+/**
+ * Applies a tone table to every pixel of an image
+ * @param image the input image
+ * @param table the lookup tables of the tone effect
+ * @return the new image
+ */
+Image apply_tone_table(const Image& image, const ToneTable& table)
+{
+    return transform_rows(image, [&](auto in, auto out, int)
+    {
+        apply_tone_table(table, in, out, image.width);
+    });
+}
+
+// Lookup tables of the clarendon effect for one scaling factor
+struct ClarendonTables
+{
+    // Tone tables for light cells, dark cells and the cells in between
+    ToneTable tables[3];
+    // Which of the tables to use for each possible sum of the red, green and blue values
+    unsigned char table_for_sum[3 * 255 + 1];
+};
+
+/**
+ * Builds the lookup tables of the clarendon effect
+ * Helper function for process_2()
+ * @param scaling_factor the scaling factor of the effect
+ * @return the lookup tables
+ */
+ClarendonTables make_clarendon_tables(double scaling_factor)
+{
+    ClarendonTables clarendon;
+    //Light cells are made lighter, dark cells darker and the rest stay the same
+    clarendon.tables[0] = make_tone_table(lighten_value, scaling_factor);
+    clarendon.tables[1] = make_tone_table(darken_value, scaling_factor);
+    clarendon.tables[2] = make_tone_table(same_value, scaling_factor);
+    for (int sum = 0; sum <= 3 * 255; sum++)
+    {
+        int average_value = sum / 3;
+        clarendon.table_for_sum[sum] = average_value >= 170 ? 0 : (average_value < 90 ? 1 : 2);
+    }
+    return clarendon;
+}
+
+/**
+ * Applies the clarendon effect to every pixel of a row, keeping any alpha value
+ * @param clarendon the lookup tables of the effect
+ * @param in        pixels of the input row
+ * @param out       pixels of the output row, may be the same as the input row
+ * @param width     number of pixels in the row
+ */
+template <typename P>
+void clarendon_row(const ClarendonTables& clarendon, const P* in, P* out, int width)
+{
+    for (int col = 0; col < width; col++)
+    {
+        const ToneTable& table = clarendon.tables[clarendon.table_for_sum[in[col].red + in[col].green + in[col].blue]];
+        out[col].blue = table.channel[0][in[col].blue];
+        out[col].green = table.channel[1][in[col].green];
+        out[col].red = table.channel[2][in[col].red];
+        copy_alpha(in[col], out[col]);
+    }
+}
+
+// PROCESS 2 - Adds clarendon type effect - darks darker and lights lighter
+Image process_2(const Image& image, double scaling_factor)
+{
+    int num_columns = image.width; //Gets the number of columns (i.e. width) of the image
+    ClarendonTables clarendon = make_clarendon_tables(scaling_factor);
+    //The new image has the same rows and columns as the original image, and keeps any alpha channel
+    return transform_rows(image, [&](auto in, auto out, int)
+    {
+        clarendon_row(clarendon, in, out, num_columns);
+    });
+}
+
+// Point effects that have vectorized kernels working on the raw bytes of a row
+enum PixelKernel
+{
+    GRAYSCALE_KERNEL,
+    HIGH_CONTRAST_KERNEL,
+    FIVE_COLOR_KERNEL
+};
+
+// Sum of the three color values at or above which the high contrast
+// effect makes a pixel white, the same as an average of at least 255/2
+const int HIGH_CONTRAST_SUM = 3 * (255/2);
+// Sums at or above which the five color effect makes a pixel white, and
+// below which it makes it black
+const int FIVE_COLOR_WHITE_SUM = 550;
+const int FIVE_COLOR_BLACK_SUM = 150;
+
+/**
+ * Converts pixels of a row with one of the vectorized point effects,
+ * without branches that depend on the pixel values, keeping any alpha value
+ * Helper function for convert_row()
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param first index of the first pixel to convert
+ * @param last  index after the last pixel to convert
+ */
+template <PixelKernel KERNEL, typename P>
+void convert_pixels(const P* in, P* out, int first, int last)
+{
+    for (int col = first; col < last; col++)
+    {
+        int red_value = in[col].red;
+        int green_value = in[col].green;
+        int blue_value = in[col].blue;
+        int sum = red_value + green_value + blue_value;
+        if (KERNEL == GRAYSCALE_KERNEL)
+        {
+            //The gray value is the average of the red, green and blue values
+            int gray_value = sum/3;
+            out[col].red = gray_value;
+            out[col].green = gray_value;
+            out[col].blue = gray_value;
+        }
+        else if (KERNEL == HIGH_CONTRAST_KERNEL)
+        {
+            //Light cells become white and dark cells black
+            int new_value = -(sum >= HIGH_CONTRAST_SUM) & 255;
+            out[col].red = new_value;
+            out[col].green = new_value;
+            out[col].blue = new_value;
+        }
+        else
+        {
+            //Light cells become white and dark cells black, the others take
+            //the color of their highest value, ties go to blue
+            int white = sum >= FIVE_COLOR_WHITE_SUM;
+            int colored = !white & (sum >= FIVE_COLOR_BLACK_SUM);
+            int red_wins = (red_value > green_value) & (red_value > blue_value);
+            int green_wins = (green_value > red_value) & (green_value > blue_value);
+            int blue_wins = !(red_wins | green_wins);
+            out[col].red = -(white | (colored & red_wins)) & 255;
+            out[col].green = -(white | (colored & green_wins)) & 255;
+            out[col].blue = -(white | (colored & blue_wins)) & 255;
+        }
+        copy_alpha(in[col], out[col]);
+    }
+}
+
+#ifdef X86_KERNELS
+// The vectorized point kernels work on the bytes of a row without
+// splitting them into channels. The loads one and two bytes before and
+// after each byte hold the other bytes of its pixel, and the masks pick
+// the right ones by the position of the byte in its pixel, so every byte
+// sees the blue, green and red values of its own pixel. Each byte is then
+// replaced by its own channel of the new pixel. Sums are computed in 16
+// bits and divided by 3 exactly as (sum * 0xAAAB) >> 17, so the results
+// match convert_pixels(). A block of three vectors always starts at a
+// pixel boundary, and all of its loads happen before its stores, so the
+// kernels also work in place. They start at the second pixel, so that
+// every load stays inside the row, and do the first pixel last.
+
+/**
+ * SSE2 point kernel, converts 16 pixels (48 bytes) per iteration
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ * @return the number of pixels done, the caller converts the rest
+ */
+template <PixelKernel KERNEL>
+__attribute__((target("sse2")))
+int convert_row_sse2(const Pixel* in, Pixel* out, int width)
+{
+    const int VECTOR = 16;
+    const int BLOCK = 3 * VECTOR;
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+
+    // masks[v][m] selects the bytes of vector v in a block that are m bytes
+    // after the start of their pixel
+    __m128i masks[3][3];
+    for (int v = 0; v < 3; v++)
+    {
+        for (int m = 0; m < 3; m++)
+        {
+            alignas(16) unsigned char bytes[VECTOR];
+            for (int i = 0; i < VECTOR; i++)
+            {
+                bytes[i] = (v * VECTOR + i) % 3 == m ? 0xFF : 0;
+            }
+            masks[v][m] = _mm_load_si128((const __m128i*)bytes);
+        }
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i one_third = _mm_set1_epi16((short)0xAAAB);
+    const __m128i contrast_limit = _mm_set1_epi16(HIGH_CONTRAST_SUM - 1);
+    const __m128i white_limit = _mm_set1_epi16(FIVE_COLOR_WHITE_SUM - 1);
+    const __m128i black_limit = _mm_set1_epi16(FIVE_COLOR_BLACK_SUM);
+
+    int pos = 3;
+    int end = width * 3;
+    for (; pos + BLOCK + 2 <= end; pos += BLOCK)
+    {
+        __m128i results[3];
+        for (int v = 0; v < 3; v++)
+        {
+            const unsigned char* p = src + pos + v * VECTOR;
+            __m128i back2 = _mm_loadu_si128((const __m128i*)(p - 2));
+            __m128i back1 = _mm_loadu_si128((const __m128i*)(p - 1));
+            __m128i here = _mm_loadu_si128((const __m128i*)p);
+            __m128i next1 = _mm_loadu_si128((const __m128i*)(p + 1));
+            __m128i next2 = _mm_loadu_si128((const __m128i*)(p + 2));
+            const __m128i* m = masks[v];
+
+            // Blue, green and red values of the pixel each byte belongs to
+            __m128i blue = _mm_or_si128(_mm_or_si128(_mm_and_si128(here, m[0]), _mm_and_si128(back1, m[1])), _mm_and_si128(back2, m[2]));
+            __m128i green = _mm_or_si128(_mm_or_si128(_mm_and_si128(next1, m[0]), _mm_and_si128(here, m[1])), _mm_and_si128(back1, m[2]));
+            __m128i red = _mm_or_si128(_mm_or_si128(_mm_and_si128(next2, m[0]), _mm_and_si128(next1, m[1])), _mm_and_si128(here, m[2]));
+
+            __m128i sum_low = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(blue, zero), _mm_unpacklo_epi8(green, zero)), _mm_unpacklo_epi8(red, zero));
+            __m128i sum_high = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(blue, zero), _mm_unpackhi_epi8(green, zero)), _mm_unpackhi_epi8(red, zero));
+            if (KERNEL == GRAYSCALE_KERNEL)
+            {
+                results[v] = _mm_packus_epi16(_mm_srli_epi16(_mm_mulhi_epu16(sum_low, one_third), 1),
+                                              _mm_srli_epi16(_mm_mulhi_epu16(sum_high, one_third), 1));
+            }
+            else if (KERNEL == HIGH_CONTRAST_KERNEL)
+            {
+                results[v] = _mm_packs_epi16(_mm_cmpgt_epi16(sum_low, contrast_limit), _mm_cmpgt_epi16(sum_high, contrast_limit));
+            }
+            else
+            {
+                __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(sum_low, white_limit), _mm_cmpgt_epi16(sum_high, white_limit));
+                __m128i black = _mm_packs_epi16(_mm_cmplt_epi16(sum_low, black_limit), _mm_cmplt_epi16(sum_high, black_limit));
+                // Unsigned comparisons as signed ones with the top bit flipped
+                __m128i b = _mm_xor_si128(blue, sign);
+                __m128i g = _mm_xor_si128(green, sign);
+                __m128i r = _mm_xor_si128(red, sign);
+                __m128i red_wins = _mm_and_si128(_mm_cmpgt_epi8(r, g), _mm_cmpgt_epi8(r, b));
+                __m128i green_wins = _mm_and_si128(_mm_cmpgt_epi8(g, r), _mm_cmpgt_epi8(g, b));
+                __m128i blue_wins = _mm_andnot_si128(_mm_or_si128(red_wins, green_wins), m[0]);
+                __m128i wins = _mm_or_si128(_mm_or_si128(_mm_and_si128(red_wins, m[2]), _mm_and_si128(green_wins, m[1])), blue_wins);
+                results[v] = _mm_or_si128(white, _mm_andnot_si128(black, wins));
+            }
+        }
+        for (int v = 0; v < 3; v++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + pos + v * VECTOR), results[v]);
+        }
+    }
+    if (pos == 3)
+    {
+        return 0;
+    }
+    convert_pixels<KERNEL>(in, out, 0, 1);
+    return pos / 3;
+}
+
+/**
+ * AVX2 point kernel, converts 32 pixels (96 bytes) per iteration. The byte
+ * unpacks and packs work within 128-bit lanes, but they undo each other
+ * and everything in between works on each value on its own.
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ * @return the number of pixels done, the caller converts the rest
+ */
+template <PixelKernel KERNEL>
+__attribute__((target("avx2")))
+int convert_row_avx2(const Pixel* in, Pixel* out, int width)
+{
+    const int VECTOR = 32;
+    const int BLOCK = 3 * VECTOR;
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+
+    // masks[v][m] selects the bytes of vector v in a block that are m bytes
+    // after the start of their pixel
+    __m256i masks[3][3];
+    for (int v = 0; v < 3; v++)
+    {
+        for (int m = 0; m < 3; m++)
+        {
+            alignas(32) unsigned char bytes[VECTOR];
+            for (int i = 0; i < VECTOR; i++)
+            {
+                bytes[i] = (v * VECTOR + i) % 3 == m ? 0xFF : 0;
+            }
+            masks[v][m] = _mm256_load_si256((const __m256i*)bytes);
+        }
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    const __m256i one_third = _mm256_set1_epi16((short)0xAAAB);
+    const __m256i contrast_limit = _mm256_set1_epi16(HIGH_CONTRAST_SUM - 1);
+    const __m256i white_limit = _mm256_set1_epi16(FIVE_COLOR_WHITE_SUM - 1);
+    const __m256i black_limit = _mm256_set1_epi16(FIVE_COLOR_BLACK_SUM);
+
+    int pos = 3;
+    int end = width * 3;
+    for (; pos + BLOCK + 2 <= end; pos += BLOCK)
+    {
+        __m256i results[3];
+        for (int v = 0; v < 3; v++)
+        {
+            const unsigned char* p = src + pos + v * VECTOR;
+            __m256i back2 = _mm256_loadu_si256((const __m256i*)(p - 2));
+            __m256i back1 = _mm256_loadu_si256((const __m256i*)(p - 1));
+            __m256i here = _mm256_loadu_si256((const __m256i*)p);
+            __m256i next1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+            __m256i next2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+            const __m256i* m = masks[v];
+
+            // Blue, green and red values of the pixel each byte belongs to
+            __m256i blue = _mm256_blendv_epi8(_mm256_blendv_epi8(here, back1, m[1]), back2, m[2]);
+            __m256i green = _mm256_blendv_epi8(_mm256_blendv_epi8(next1, here, m[1]), back1, m[2]);
+            __m256i red = _mm256_blendv_epi8(_mm256_blendv_epi8(next2, next1, m[1]), here, m[2]);
+
+            __m256i sum_low = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(blue, zero), _mm256_unpacklo_epi8(green, zero)), _mm256_unpacklo_epi8(red, zero));
+            __m256i sum_high = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(blue, zero), _mm256_unpackhi_epi8(green, zero)), _mm256_unpackhi_epi8(red, zero));
+            if (KERNEL == GRAYSCALE_KERNEL)
+            {
+                results[v] = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_mulhi_epu16(sum_low, one_third), 1),
+                                                 _mm256_srli_epi16(_mm256_mulhi_epu16(sum_high, one_third), 1));
+            }
+            else if (KERNEL == HIGH_CONTRAST_KERNEL)
+            {
+                results[v] = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum_low, contrast_limit), _mm256_cmpgt_epi16(sum_high, contrast_limit));
+            }
+            else
+            {
+                __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum_low, white_limit), _mm256_cmpgt_epi16(sum_high, white_limit));
+                __m256i black = _mm256_packs_epi16(_mm256_cmpgt_epi16(black_limit, sum_low), _mm256_cmpgt_epi16(black_limit, sum_high));
+                // Unsigned comparisons as signed ones with the top bit flipped
+                __m256i b = _mm256_xor_si256(blue, sign);
+                __m256i g = _mm256_xor_si256(green, sign);
+                __m256i r = _mm256_xor_si256(red, sign);
+                __m256i red_wins = _mm256_and_si256(_mm256_cmpgt_epi8(r, g), _mm256_cmpgt_epi8(r, b));
+                __m256i green_wins = _mm256_and_si256(_mm256_cmpgt_epi8(g, r), _mm256_cmpgt_epi8(g, b));
+                __m256i blue_wins = _mm256_andnot_si256(_mm256_or_si256(red_wins, green_wins), m[0]);
+                __m256i wins = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(red_wins, m[2]), _mm256_and_si256(green_wins, m[1])), blue_wins);
+                results[v] = _mm256_or_si256(white, _mm256_andnot_si256(black, wins));
+            }
+        }
+        for (int v = 0; v < 3; v++)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + pos + v * VECTOR), results[v]);
+        }
+    }
+    if (pos == 3)
+    {
+        return 0;
+    }
+    convert_pixels<KERNEL>(in, out, 0, 1);
+    return pos / 3;
+}
+
+/**
+ * AVX-512 point kernel, converts 64 pixels (192 bytes) per iteration
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ * @return the number of pixels done, the caller converts the rest
+ */
+template <PixelKernel KERNEL>
+__attribute__((target("avx512bw")))
+int convert_row_avx512(const Pixel* in, Pixel* out, int width)
+{
+    const int VECTOR = 64;
+    const int BLOCK = 3 * VECTOR;
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+
+    // masks[v][m] selects the bytes of vector v in a block that are m bytes
+    // after the start of their pixel
+    __mmask64 masks[3][3];
+    for (int v = 0; v < 3; v++)
+    {
+        for (int m = 0; m < 3; m++)
+        {
+            masks[v][m] = 0;
+            for (int i = 0; i < VECTOR; i++)
+            {
+                if ((v * VECTOR + i) % 3 == m)
+                {
+                    masks[v][m] |= (__mmask64)1 << i;
+                }
+            }
+        }
+    }
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one_third = _mm512_set1_epi16((short)0xAAAB);
+    const __m512i contrast_limit = _mm512_set1_epi16(HIGH_CONTRAST_SUM - 1);
+    const __m512i white_limit = _mm512_set1_epi16(FIVE_COLOR_WHITE_SUM - 1);
+    const __m512i black_limit = _mm512_set1_epi16(FIVE_COLOR_BLACK_SUM);
+
+    int pos = 3;
+    int end = width * 3;
+    for (; pos + BLOCK + 2 <= end; pos += BLOCK)
+    {
+        __m512i results[3];
+        for (int v = 0; v < 3; v++)
+        {
+            const unsigned char* p = src + pos + v * VECTOR;
+            __m512i back2 = _mm512_loadu_si512(p - 2);
+            __m512i back1 = _mm512_loadu_si512(p - 1);
+            __m512i here = _mm512_loadu_si512(p);
+            __m512i next1 = _mm512_loadu_si512(p + 1);
+            __m512i next2 = _mm512_loadu_si512(p + 2);
+            const __mmask64* m = masks[v];
+
+            // Blue, green and red values of the pixel each byte belongs to
+            __m512i blue = _mm512_mask_blend_epi8(m[2], _mm512_mask_blend_epi8(m[1], here, back1), back2);
+            __m512i green = _mm512_mask_blend_epi8(m[2], _mm512_mask_blend_epi8(m[1], next1, here), back1);
+            __m512i red = _mm512_mask_blend_epi8(m[2], _mm512_mask_blend_epi8(m[1], next2, next1), here);
+
+            __m512i sum_low = _mm512_add_epi16(_mm512_add_epi16(_mm512_unpacklo_epi8(blue, zero), _mm512_unpacklo_epi8(green, zero)), _mm512_unpacklo_epi8(red, zero));
+            __m512i sum_high = _mm512_add_epi16(_mm512_add_epi16(_mm512_unpackhi_epi8(blue, zero), _mm512_unpackhi_epi8(green, zero)), _mm512_unpackhi_epi8(red, zero));
+            if (KERNEL == GRAYSCALE_KERNEL)
+            {
+                results[v] = _mm512_packus_epi16(_mm512_srli_epi16(_mm512_mulhi_epu16(sum_low, one_third), 1),
+                                                 _mm512_srli_epi16(_mm512_mulhi_epu16(sum_high, one_third), 1));
+            }
+            else if (KERNEL == HIGH_CONTRAST_KERNEL)
+            {
+                results[v] = _mm512_packs_epi16(_mm512_movm_epi16(_mm512_cmpgt_epi16_mask(sum_low, contrast_limit)),
+                                                _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(sum_high, contrast_limit)));
+            }
+            else
+            {
+                __mmask64 white = _mm512_movepi8_mask(_mm512_packs_epi16(_mm512_movm_epi16(_mm512_cmpgt_epi16_mask(sum_low, white_limit)),
+                                                                         _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(sum_high, white_limit))));
+                __mmask64 black = _mm512_movepi8_mask(_mm512_packs_epi16(_mm512_movm_epi16(_mm512_cmplt_epi16_mask(sum_low, black_limit)),
+                                                                         _mm512_movm_epi16(_mm512_cmplt_epi16_mask(sum_high, black_limit))));
+                __mmask64 red_wins = _mm512_cmpgt_epu8_mask(red, green) & _mm512_cmpgt_epu8_mask(red, blue);
+                __mmask64 green_wins = _mm512_cmpgt_epu8_mask(green, red) & _mm512_cmpgt_epu8_mask(green, blue);
+                __mmask64 wins = (red_wins & m[2]) | (green_wins & m[1]) | (~(red_wins | green_wins) & m[0]);
+                results[v] = _mm512_movm_epi8(white | (~black & wins));
+            }
+        }
+        for (int v = 0; v < 3; v++)
+        {
+            _mm512_storeu_si512(dst + pos + v * VECTOR, results[v]);
+        }
+    }
+    if (pos == 3)
+    {
+        return 0;
+    }
+    convert_pixels<KERNEL>(in, out, 0, 1);
+    return pos / 3;
+}
+
+/**
+ * AVX2 point kernel for four channel pixels, converts 8 pixels per
+ * iteration. Every pixel is one 32-bit lane, so the channels are split
+ * with shifts and masks instead of byte shuffles, and the alpha byte of
+ * each lane is put back unchanged.
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ * @return the number of pixels done, the caller converts the rest
+ */
+template <PixelKernel KERNEL>
+__attribute__((target("avx2")))
+int convert_row_bgra_avx2(const PixelBGRA* in, PixelBGRA* out, int width)
+{
+    const int VECTOR = 8;
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i color_bytes = _mm256_set1_epi32(0xFFFFFF);
+    const __m256i alpha_byte = _mm256_set1_epi32((int)0xFF000000);
+    int col = 0;
+    for (; col + VECTOR <= width; col += VECTOR)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(in + col));
+        __m256i blue = _mm256_and_si256(pixels, low_byte);
+        __m256i green = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), low_byte);
+        __m256i red = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), low_byte);
+        __m256i sum = _mm256_add_epi32(_mm256_add_epi32(blue, green), red);
+        __m256i result;
+        if (KERNEL == GRAYSCALE_KERNEL)
+        {
+            // The sum fits in the low 16 bits of its lane, so the division
+            // by 3 is the same (sum * 0xAAAB) >> 17 as the byte kernels
+            __m256i gray = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, _mm256_set1_epi32(0xAAAB)), 1);
+            result = _mm256_or_si256(_mm256_or_si256(gray, _mm256_slli_epi32(gray, 8)), _mm256_slli_epi32(gray, 16));
+        }
+        else if (KERNEL == HIGH_CONTRAST_KERNEL)
+        {
+            __m256i white = _mm256_cmpgt_epi32(sum, _mm256_set1_epi32(HIGH_CONTRAST_SUM - 1));
+            result = _mm256_and_si256(white, color_bytes);
+        }
+        else
+        {
+            __m256i white = _mm256_cmpgt_epi32(sum, _mm256_set1_epi32(FIVE_COLOR_WHITE_SUM - 1));
+            __m256i black = _mm256_cmpgt_epi32(_mm256_set1_epi32(FIVE_COLOR_BLACK_SUM), sum);
+            __m256i red_wins = _mm256_and_si256(_mm256_cmpgt_epi32(red, green), _mm256_cmpgt_epi32(red, blue));
+            __m256i green_wins = _mm256_and_si256(_mm256_cmpgt_epi32(green, red), _mm256_cmpgt_epi32(green, blue));
+            // Ties go to blue, like in convert_pixels()
+            __m256i color = _mm256_or_si256(
+                _mm256_or_si256(_mm256_and_si256(red_wins, _mm256_set1_epi32(0xFF0000)),
+                                _mm256_and_si256(green_wins, _mm256_set1_epi32(0xFF00))),
+                _mm256_andnot_si256(_mm256_or_si256(red_wins, green_wins), low_byte));
+            result = _mm256_or_si256(_mm256_and_si256(white, color_bytes), _mm256_andnot_si256(black, color));
+        }
+        result = _mm256_or_si256(result, _mm256_and_si256(pixels, alpha_byte));
+        _mm256_storeu_si256((__m256i*)(out + col), result);
+    }
+    return col;
+}
+#endif
+
+/**
+ * Converts every pixel of a row with one of the vectorized point effects,
+ * using the fastest kernel the processor supports
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ */
+template <PixelKernel KERNEL>
+void convert_row(const Pixel* in, Pixel* out, int width)
+{
+    int done = 0;
+#ifdef X86_KERNELS
+    switch (simd_level())
+    {
+        case SIMD_AVX512: done = convert_row_avx512<KERNEL>(in, out, width); break;
+        case SIMD_AVX2: done = convert_row_avx2<KERNEL>(in, out, width); break;
+        case SIMD_SSE2: done = convert_row_sse2<KERNEL>(in, out, width); break;
+        case SIMD_NONE: break;
+    }
+#endif
+    convert_pixels<KERNEL>(in, out, done, width);
+}
+
+/**
+ * Converts every pixel of a row of four channel pixels with one of the
+ * vectorized point effects, keeping the alpha values
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ */
+template <PixelKernel KERNEL>
+void convert_row(const PixelBGRA* in, PixelBGRA* out, int width)
+{
+    int done = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        done = convert_row_bgra_avx2<KERNEL>(in, out, width);
+    }
+#endif
+    convert_pixels<KERNEL>(in, out, done, width);
+}
+
+/**
+ * Converts every pixel of a row to gray
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ */
+template <typename P>
+void grayscale_row(const P* in, P* out, int width)
+{
+    convert_row<GRAYSCALE_KERNEL>(in, out, width);
+}
+
+//PROCESS 3 - Greyscale
+Image process_3(const Image& image)
+{
+    int num_columns = image.width; //Gets the number of columns (i.e. width) of the image
+    //The new image has the same rows and columns as the original image, and keeps any alpha channel
+    return transform_rows(image, [&](auto in, auto out, int)
+    {
+        grayscale_row(in, out, num_columns);
+    });
+}
+
+// Side in pixels of the square tiles the rotation kernel works in. A source
+// tile and a destination tile fit in the L1 cache together.
+const int ROTATE_TILE_SIZE = 32;
+
+/**
+ * Rotates an image clockwise by a number of quarter turns in a single pass.
+ * For 90 and 270 degrees the image is walked in square tiles, so the
+ * strided side of the transpose stays within a few cached rows instead of
+ * touching a new row of the whole image for every pixel. For 180 degrees
+ * every row is copied in reverse into its mirrored row.
+ * Helper function for rotate_into(), for either pixel type
+ * @param image         the input image
+ * @param new_image     the rotated image, already of the rotated size
+ * @param quarter_turns number of clockwise quarter turns, 1, 2 or 3
+ */
+template <typename P>
+void rotate_pixels(const Image& image, Image& new_image, int quarter_turns)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    if (quarter_turns == 2)
+    {
+        parallel_rows(num_rows, num_columns, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                const P* in = image.row<P>(row);
+                P* out = new_image.row<P>(num_rows - row - 1);
+                for (int col = 0; col < num_columns; col++)
+                {
+                    out[num_columns - col - 1] = in[col];
+                }
+            }
+        });
+        return;
+    }
+
+    // The bands are strips of source columns, so each thread writes whole rows of the new image
+    int column_tiles = (num_columns + ROTATE_TILE_SIZE - 1) / ROTATE_TILE_SIZE;
+    parallel_rows(column_tiles, ROTATE_TILE_SIZE * num_rows, [&](int first_tile, int last_tile)
+    {
+        int band_start = first_tile * ROTATE_TILE_SIZE;
+        int band_end = min(last_tile * ROTATE_TILE_SIZE, num_columns);
+        for (int row_start = 0; row_start < num_rows; row_start += ROTATE_TILE_SIZE)
+        {
+            int row_end = min(row_start + ROTATE_TILE_SIZE, num_rows);
+            for (int col_start = band_start; col_start < band_end; col_start += ROTATE_TILE_SIZE)
+            {
+                int col_end = min(col_start + ROTATE_TILE_SIZE, band_end);
+                // Each column of the source tile becomes part of one row of the new image
+                for (int col = col_start; col < col_end; col++)
+                {
+                    if (quarter_turns == 1)
+                    {
+                        P* out = new_image.row<P>(col);
+                        for (int row = row_start; row < row_end; row++)
+                        {
+                            out[num_rows - row - 1] = image.row<P>(row)[col];
+                        }
+                    }
+                    else
+                    {
+                        P* out = new_image.row<P>(num_columns - col - 1);
+                        for (int row = row_start; row < row_end; row++)
+                        {
+                            out[row] = image.row<P>(row)[col];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+/**
+ * Rotates an image clockwise by a number of quarter turns into an image
+ * the caller supplies, moving any alpha values with their pixels
+ * @param image         the input image
+ * @param new_image     the rotated image, with the rotated width and height
+ *                      and the same channels as the input image
+ * @param quarter_turns number of clockwise quarter turns, 1, 2 or 3
+ */
+void rotate_into(const Image& image, Image& new_image, int quarter_turns)
+{
+    if (image.channels == 4)
+    {
+        rotate_pixels<PixelBGRA>(image, new_image, quarter_turns);
+    }
+    else
+    {
+        rotate_pixels<Pixel>(image, new_image, quarter_turns);
+    }
+}
+
+/**
+ * Rotates an image clockwise by a number of quarter turns in a single pass
+ * @param image         the input image
+ * @param quarter_turns number of clockwise quarter turns, 1, 2 or 3
+ * @return the rotated image
+ */
+Image rotate_image(const Image& image, int quarter_turns)
+{
+    Image new_image = quarter_turns == 2 ? Image(image.width, image.height, image.channels)
+                                         : Image(image.height, image.width, image.channels);
+    rotate_into(image, new_image, quarter_turns);
+    return new_image;
+}
+
+//PROCESS 4 - Rotate by 90 degrees
+Image process_4(const Image& image)
+{
+    //Each pixel at row, col moves to row col, column num_rows - row - 1 of the rotated image
+    return rotate_image(image, 1);
+}
+
+//PROCESS 5 - Rotate by multiples of 90 degrees
+Image process_5(const Image& image, int number)
+{
+    //take the number of rotations and divide it by 4 to get the remainder (0 to 3, also for negative numbers)
+    int quarter_turns = (number % 4 + 4) % 4;
+    //rotate 0 times if remainder is 0, copies of an image share its pixels so nothing is copied
+    if (quarter_turns == 0) {return image;}
+    //otherwise rotate by 90, 180 or 270 degrees in a single pass
+    return rotate_image(image, quarter_turns);
+}
+
+/**
+ * Writes every pixel of a row SCALE times in a row, for a scale known at
+ * compile time so the inner copies are unrolled
+ * Helper function for enlarge_row()
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, SCALE times as wide
+ * @param width number of pixels in the input row
+ */
+template <int SCALE, typename P>
+void enlarge_row_by(const P* in, P* out, int width)
+{
+    for (int col = 0; col < width; col++)
+    {
+        for (int copy = 0; copy < SCALE; copy++)
+        {
+            out[copy] = in[col];
+        }
+        out = out + SCALE;
+    }
+}
+
+/**
+ * Writes every pixel of a row x_scale times in a row
+ * Helper function for process_6()
+ * @param in      pixels of the input row
+ * @param out     pixels of the output row, x_scale times as wide
+ * @param width   number of pixels in the input row
+ * @param x_scale number of copies of each pixel
+ */
+template <typename P>
+void enlarge_row(const P* in, P* out, int width, int x_scale)
+{
+    switch (x_scale)
+    {
+        case 1: memcpy(out, in, (size_t)width * sizeof(P)); return;
+        case 2: enlarge_row_by<2>(in, out, width); return;
+        case 3: enlarge_row_by<3>(in, out, width); return;
+        case 4: enlarge_row_by<4>(in, out, width); return;
+    }
+    for (int col = 0; col < width; col++)
+    {
+        fill(out, out + x_scale, in[col]);
+        out = out + x_scale;
+    }
+}
+
+//PROCESS 6 - Enlarges in the x and y direction
+Image process_6(const Image& image, int x_scale, int y_scale)
+{
+    //Scales must be at least 1
+    if (x_scale < 1 || y_scale < 1)
+    {
+        return {};
+    }
+    int num_rows = image.height; //Gets the number of rows (i.e. height) of the image
+    int num_columns = image.width; //Gets the number of columns (i.e. width) of the image
+    int new_row = num_rows * y_scale; //Gets the new height
+    int new_col = num_columns * x_scale; //Gets the new width
+    Image new_image(new_col, new_row, image.channels); //define a new image and set it to have new size based on x_scale and y_scale
+    size_t new_row_bytes = (size_t)new_col * image.channels;
+    parallel_rows(num_rows, new_col * y_scale, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            //Each pixel of the original row is repeated x_scale times to build the first of its new rows
+            if (image.channels == 4)
+            {
+                enlarge_row(image.bgra(row), new_image.bgra(row * y_scale), num_columns, x_scale);
+            }
+            else
+            {
+                enlarge_row(image[row], new_image[row * y_scale], num_columns, x_scale);
+            }
+            //The other y_scale - 1 new rows are copies of it
+            for (int copy = 1; copy < y_scale; copy++)
+            {
+                memcpy(new_image.row_bytes(row * y_scale + copy), new_image.row_bytes(row * y_scale), new_row_bytes);
+            }
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Converts every pixel of a row to black or white
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ */
+template <typename P>
+void high_contrast_row(const P* in, P* out, int width)
+{
+    //If the cell is light (by its gray value), make it white, otherwise make it black
+    convert_row<HIGH_CONTRAST_KERNEL>(in, out, width);
+}
+
+//PROCESS 7 - Converts image to high contrast - black and white only
+Image process_7(const Image& image) 
+{
+    int num_columns = image.width; //Gets the number of columns (i.e. width) of the image
+    //The new image has the same rows and columns as the original image, and keeps any alpha channel
+    return transform_rows(image, [&](auto in, auto out, int)
+    {
+        high_contrast_row(in, out, num_columns);
+    });
+}
+
+//PROCESS 8 - Lightens image
+Image process_8(const Image& image, double scaling_factor) 
+{
+    //Calculate the new value of every possible red, green and blue value once, based on scaling factor
+    return apply_tone_table(image, make_tone_table(lighten_value, scaling_factor));
+}
+
+//PROCESS 9 - Darkens image
+Image process_9(const Image& image, double scaling_factor) 
+{
+    //Calculate the new value of every possible red, green and blue value once - multiply by a scaling factor less than 1 to make the color darker
+    return apply_tone_table(image, make_tone_table(darken_value, scaling_factor));
+}
+
+/**
+ * Converts every pixel of a row to black, white, red, green or blue
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param width number of pixels in the row
+ */
+template <typename P>
+void five_color_row(const P* in, P* out, int width)
+{
+    //Light cells become white, dark cells black, and the others red, green or blue by their highest value
+    convert_row<FIVE_COLOR_KERNEL>(in, out, width);
+}
+
+//PROCESS 10 - Converts to only black, white, red, blue and green
+Image process_10(const Image& image)
+{
+    int num_columns = image.width; //Gets the number of columns (i.e. width) of the image
+    //The new image has the same rows and columns as the original image, and keeps any alpha channel
+    return transform_rows(image, [&](auto in, auto out, int)
+    {
+        five_color_row(in, out, num_columns);
+    });
+}
+
+// Effect and its parameters, one step of an effect chain
+struct Effect
+{
+    // The process number of the effect
+    int number = 0;
+    // Scaling factor of effects 2, 8 and 9
+    double scaling_factor = 0;
+    // Number of quarter turns of effect 5
+    int quarter_turns = 0;
+    // Horizontal and vertical scales of effect 6
+    int x_scale = 1;
+    int y_scale = 1;
+};
+
+/**
+ * Checks whether an effect only changes each pixel on its own, so that it
+ * can be part of an effect pipeline
+ * @param number the process number of the effect
+ * @return true for effects 1, 2, 3, 7, 8, 9 and 10
+ */
+bool is_point_effect(int number)
+{
+    return number == 1 || number == 2 || number == 3 || (number >= 7 && number <= 10);
+}
+
+// Pipeline step with everything its row kernel needs, prepared once per image
+struct PipelineStep
+{
+    int number = 0;
+    // Vignette scaling factors for effect 1, null if computed row by row
+    shared_ptr<const VignetteMap> vignette;
+    // Lookup tables for effect 2
+    shared_ptr<ClarendonTables> clarendon;
+    // Lookup tables for effects 8 and 9
+    ToneTable tone;
+};
+
+/**
+ * Runs one pipeline step on a row
+ * Helper function for apply_pipeline()
+ * @param step  the prepared step
+ * @param in    pixels of the input row
+ * @param out   pixels of the output row, may be the same as the input row
+ * @param row   index of the row in the image
+ * @param width number of pixels in the row
+ * @param row_factors vignette scaling factors of the row, for effect 1
+ *                    steps without a vignette map
+ */
+template <typename P>
+void run_step(const PipelineStep& step, const P* in, P* out, int row, int width, const double* row_factors)
+{
+    switch (step.number)
+    {
+        case 1: vignette_row(in, out, width, step.vignette ? step.vignette->row_factors(row) : row_factors); break;
+        case 2: clarendon_row(*step.clarendon, in, out, width); break;
+        case 3: grayscale_row(in, out, width); break;
+        case 7: high_contrast_row(in, out, width); break;
+        case 8:
+        case 9: apply_tone_table(step.tone, in, out, width); break;
+        case 10: five_color_row(in, out, width); break;
+    }
+}
+
+/**
+ * Prepares the lookup tables and scaling factors of every step of an
+ * effect pipeline up front
+ * @param effects       the effects, in order
+ * @param width         width of the image in pixels
+ * @param height        height of the image in pixels
+ * @param vignette_maps whether effect 1 steps get a whole VignetteMap, or
+ *                      leave their scaling factors to be computed row by row
+ * @return the steps, empty if an effect is not pixel-local
+ */
+vector<PipelineStep> prepare_steps(const vector<Effect>& effects, int width, int height, bool vignette_maps)
+{
+    vector<PipelineStep> steps(effects.size());
+    for (size_t i = 0; i < effects.size(); i++)
+    {
+        const Effect& effect = effects[i];
+        if (!is_point_effect(effect.number))
+        {
+            return {};
+        }
+        steps[i].number = effect.number;
+        if (effect.number == 1 && vignette_maps)
+        {
+            steps[i].vignette = get_vignette_map(width, height);
+        }
+        else if (effect.number == 2)
+        {
+            steps[i].clarendon = make_shared<ClarendonTables>(make_clarendon_tables(effect.scaling_factor));
+        }
+        else if (effect.number == 8)
+        {
+            steps[i].tone = make_tone_table(lighten_value, effect.scaling_factor);
+        }
+        else if (effect.number == 9)
+        {
+            steps[i].tone = make_tone_table(darken_value, effect.scaling_factor);
+        }
+    }
+    return steps;
+}
+
+#ifdef X86_KERNELS
+/**
+ * Splits 16 pixels (48 bytes) per iteration into their planes with byte
+ * shuffles. Each output vector is put together from the three input
+ * vectors, masks[c][v] picking the channel c values found in vector v.
+ * Uses SSSE3 shuffles, which every AVX2 processor has.
+ * @param in     pixels of the row
+ * @param planes blue, green and red values of the row
+ * @param width  number of pixels in the row
+ * @return the number of pixels done, the caller splits the rest
+ */
+__attribute__((target("avx2")))
+int split_row_avx2(const Pixel* in, unsigned char* const planes[3], int width)
+{
+    const int VECTOR = 16;
+    __m128i masks[3][3];
+    for (int c = 0; c < 3; c++)
+    {
+        for (int v = 0; v < 3; v++)
+        {
+            alignas(16) signed char mask[VECTOR];
+            for (int i = 0; i < VECTOR; i++)
+            {
+                int pos = 3 * i + c - VECTOR * v;
+                mask[i] = pos >= 0 && pos < VECTOR ? pos : -1;
+            }
+            masks[c][v] = _mm_load_si128((const __m128i*)mask);
+        }
+    }
+    const unsigned char* src = (const unsigned char*)in;
+    int col = 0;
+    for (; col + VECTOR <= width; col += VECTOR)
+    {
+        __m128i vectors[3];
+        for (int v = 0; v < 3; v++)
+        {
+            vectors[v] = _mm_loadu_si128((const __m128i*)(src + 3 * col + VECTOR * v));
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            __m128i values = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vectors[0], masks[c][0]),
+                                                       _mm_shuffle_epi8(vectors[1], masks[c][1])),
+                                          _mm_shuffle_epi8(vectors[2], masks[c][2]));
+            _mm_storeu_si128((__m128i*)(planes[c] + col), values);
+        }
+    }
+    return col;
+}
+
+/**
+ * Merges 16 pixels (48 bytes) per iteration from their planes, the
+ * reverse of split_row_avx2(). masks[c][v] places the channel c values
+ * that belong in output vector v.
+ * @param planes blue, green and red values of the row
+ * @param out    pixels of the row
+ * @param width  number of pixels in the row
+ * @return the number of pixels done, the caller merges the rest
+ */
+__attribute__((target("avx2")))
+int merge_row_avx2(const unsigned char* const planes[3], Pixel* out, int width)
+{
+    const int VECTOR = 16;
+    __m128i masks[3][3];
+    for (int c = 0; c < 3; c++)
+    {
+        for (int v = 0; v < 3; v++)
+        {
+            alignas(16) signed char mask[VECTOR];
+            for (int i = 0; i < VECTOR; i++)
+            {
+                int pos = VECTOR * v + i;
+                mask[i] = pos % 3 == c ? pos / 3 : -1;
+            }
+            masks[c][v] = _mm_load_si128((const __m128i*)mask);
+        }
+    }
+    unsigned char* dst = (unsigned char*)out;
+    int col = 0;
+    for (; col + VECTOR <= width; col += VECTOR)
+    {
+        __m128i values[3];
+        for (int c = 0; c < 3; c++)
+        {
+            values[c] = _mm_loadu_si128((const __m128i*)(planes[c] + col));
+        }
+        for (int v = 0; v < 3; v++)
+        {
+            __m128i bytes = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(values[0], masks[0][v]),
+                                                      _mm_shuffle_epi8(values[1], masks[1][v])),
+                                         _mm_shuffle_epi8(values[2], masks[2][v]));
+            _mm_storeu_si128((__m128i*)(dst + 3 * col + VECTOR * v), bytes);
+        }
+    }
+    return col;
+}
+#endif
+
+/**
+ * Splits a row of pixels into one row per channel
+ * @param in     pixels of the row
+ * @param planes blue, green and red values of the row
+ * @param width  number of pixels in the row
+ */
+void split_row(const Pixel* in, unsigned char* const planes[3], int width)
+{
+    int col = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        col = split_row_avx2(in, planes, width);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        planes[0][col] = in[col].blue;
+        planes[1][col] = in[col].green;
+        planes[2][col] = in[col].red;
+    }
+}
+
+/**
+ * Merges one row per channel back into a row of pixels
+ * @param planes blue, green and red values of the row
+ * @param out    pixels of the row
+ * @param width  number of pixels in the row
+ */
+void merge_row(const unsigned char* const planes[3], Pixel* out, int width)
+{
+    int col = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        col = merge_row_avx2(planes, out, width);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        out[col].blue = planes[0][col];
+        out[col].green = planes[1][col];
+        out[col].red = planes[2][col];
+    }
+}
+
+/**
+ * Converts a three channel image to the planar layout
+ * @param image the input image
+ * @return the planar image
+ */
+PlanarImage to_planar(const Image& image)
+{
+    PlanarImage planar(image.width, image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            unsigned char* planes[3] = {planar.plane(0, row), planar.plane(1, row), planar.plane(2, row)};
+            split_row(image[row], planes, image.width);
+        }
+    });
+    return planar;
+}
+
+/**
+ * Converts a planar image back to the interleaved layout of BMP files
+ * @param planar the planar image
+ * @return the three channel image
+ */
+Image to_interleaved(const PlanarImage& planar)
+{
+    Image image(planar.width, planar.height);
+    parallel_rows(planar.height, planar.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            const unsigned char* planes[3] = {planar.plane(0, row), planar.plane(1, row), planar.plane(2, row)};
+            merge_row(planes, image[row], planar.width);
+        }
+    });
+    return image;
+}
+
+/**
+ * Converts values of a planar row with one of the vectorized point
+ * effects, the same way as convert_pixels()
+ * Helper function for convert_planar()
+ * @param planes blue, green and red values of the row, converted in place
+ * @param first  index of the first pixel to convert
+ * @param last   index after the last pixel to convert
+ */
+template <PixelKernel KERNEL>
+void convert_planar_pixels(unsigned char* const planes[3], int first, int last)
+{
+    unsigned char* blue = planes[0];
+    unsigned char* green = planes[1];
+    unsigned char* red = planes[2];
+    for (int col = first; col < last; col++)
+    {
+        int red_value = red[col];
+        int green_value = green[col];
+        int blue_value = blue[col];
+        int sum = red_value + green_value + blue_value;
+        if (KERNEL == GRAYSCALE_KERNEL)
+        {
+            int gray_value = sum/3;
+            red[col] = gray_value;
+            green[col] = gray_value;
+            blue[col] = gray_value;
+        }
+        else if (KERNEL == HIGH_CONTRAST_KERNEL)
+        {
+            int new_value = -(sum >= HIGH_CONTRAST_SUM) & 255;
+            red[col] = new_value;
+            green[col] = new_value;
+            blue[col] = new_value;
+        }
+        else
+        {
+            int white = sum >= FIVE_COLOR_WHITE_SUM;
+            int colored = !white & (sum >= FIVE_COLOR_BLACK_SUM);
+            int red_wins = (red_value > green_value) & (red_value > blue_value);
+            int green_wins = (green_value > red_value) & (green_value > blue_value);
+            int blue_wins = !(red_wins | green_wins);
+            red[col] = -(white | (colored & red_wins)) & 255;
+            green[col] = -(white | (colored & green_wins)) & 255;
+            blue[col] = -(white | (colored & blue_wins)) & 255;
+        }
+    }
+}
+
+#ifdef X86_KERNELS
+/**
+ * AVX2 point kernel for planar rows, converts 32 pixels per iteration.
+ * With one channel per vector no shuffles are needed: the sums are made
+ * in 16 bits from the unpacked halves, which the packs put back in order,
+ * and the channel comparisons work directly on the bytes.
+ * @param planes blue, green and red values of the row, converted in place
+ * @param width  number of pixels in the row
+ * @return the number of pixels done, the caller converts the rest
+ */
+template <PixelKernel KERNEL>
+__attribute__((target("avx2")))
+int convert_planar_avx2(unsigned char* const planes[3], int width)
+{
+    const int VECTOR = 32;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    // Flipping the top bit turns the unsigned byte order into the signed one
+    const __m256i sign_bit = _mm256_set1_epi8(-128);
+    int col = 0;
+    for (; col + VECTOR <= width; col += VECTOR)
+    {
+        __m256i blue = _mm256_loadu_si256((const __m256i*)(planes[0] + col));
+        __m256i green = _mm256_loadu_si256((const __m256i*)(planes[1] + col));
+        __m256i red = _mm256_loadu_si256((const __m256i*)(planes[2] + col));
+        __m256i sum_low = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(blue, zero), _mm256_unpacklo_epi8(green, zero)),
+                                           _mm256_unpacklo_epi8(red, zero));
+        __m256i sum_high = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(blue, zero), _mm256_unpackhi_epi8(green, zero)),
+                                            _mm256_unpackhi_epi8(red, zero));
+        __m256i new_blue, new_green, new_red;
+        if (KERNEL == GRAYSCALE_KERNEL)
+        {
+            const __m256i third = _mm256_set1_epi16((short)0xAAAB);
+            __m256i gray_low = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_low, third), 1);
+            __m256i gray_high = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_high, third), 1);
+            new_blue = new_green = new_red = _mm256_packus_epi16(gray_low, gray_high);
+        }
+        else if (KERNEL == HIGH_CONTRAST_KERNEL)
+        {
+            const __m256i limit = _mm256_set1_epi16(HIGH_CONTRAST_SUM - 1);
+            new_blue = new_green = new_red = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum_low, limit),
+                                                                _mm256_cmpgt_epi16(sum_high, limit));
+        }
+        else
+        {
+            const __m256i white_limit = _mm256_set1_epi16(FIVE_COLOR_WHITE_SUM - 1);
+            const __m256i black_limit = _mm256_set1_epi16(FIVE_COLOR_BLACK_SUM);
+            __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum_low, white_limit),
+                                               _mm256_cmpgt_epi16(sum_high, white_limit));
+            __m256i black = _mm256_packs_epi16(_mm256_cmpgt_epi16(black_limit, sum_low),
+                                               _mm256_cmpgt_epi16(black_limit, sum_high));
+            __m256i signed_blue = _mm256_xor_si256(blue, sign_bit);
+            __m256i signed_green = _mm256_xor_si256(green, sign_bit);
+            __m256i signed_red = _mm256_xor_si256(red, sign_bit);
+            __m256i red_wins = _mm256_and_si256(_mm256_cmpgt_epi8(signed_red, signed_green), _mm256_cmpgt_epi8(signed_red, signed_blue));
+            __m256i green_wins = _mm256_and_si256(_mm256_cmpgt_epi8(signed_green, signed_red), _mm256_cmpgt_epi8(signed_green, signed_blue));
+            __m256i blue_wins = _mm256_andnot_si256(_mm256_or_si256(red_wins, green_wins), ones);
+            // White wins over everything, black over the colors
+            new_red = _mm256_or_si256(white, _mm256_andnot_si256(black, red_wins));
+            new_green = _mm256_or_si256(white, _mm256_andnot_si256(black, green_wins));
+            new_blue = _mm256_or_si256(white, _mm256_andnot_si256(black, blue_wins));
+        }
+        _mm256_storeu_si256((__m256i*)(planes[0] + col), new_blue);
+        _mm256_storeu_si256((__m256i*)(planes[1] + col), new_green);
+        _mm256_storeu_si256((__m256i*)(planes[2] + col), new_red);
+    }
+    return col;
+}
+#endif
+
+/**
+ * Converts every pixel of a planar row with one of the vectorized point
+ * effects, using the fastest kernel the processor supports
+ * @param planes blue, green and red values of the row, converted in place
+ * @param width  number of pixels in the row
+ */
+template <PixelKernel KERNEL>
+void convert_planar(unsigned char* const planes[3], int width)
+{
+    int done = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        done = convert_planar_avx2<KERNEL>(planes, width);
+    }
+#endif
+    convert_planar_pixels<KERNEL>(planes, done, width);
+}
+
+#ifdef X86_KERNELS
+/**
+ * AVX2 version of vignette_planar(), scales 4 pixels per iteration
+ * @param blue    blue values of the row
+ * @param green   green values of the row
+ * @param red     red values of the row
+ * @param width   number of pixels in the row
+ * @param factors scaling factor of every pixel in the row
+ * @return the number of pixels done, the caller scales the rest
+ */
+__attribute__((target("avx2")))
+int vignette_planar_avx2(unsigned char* blue, unsigned char* green, unsigned char* red, int width, const double* factors)
+{
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    unsigned char* planes[3] = {blue, green, red};
+    int col = 0;
+    for (; col + 4 <= width; col += 4)
+    {
+        __m256d f = _mm256_loadu_pd(factors + col);
+        for (unsigned char* values : planes)
+        {
+            int bytes;
+            memcpy(&bytes, values + col, 4);
+            __m256d scaled = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes))), f);
+            // Keep the low byte of each result, like storing an int in an unsigned char
+            __m128i truncated = _mm_and_si128(_mm256_cvttpd_epi32(scaled), low_byte);
+            bytes = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(truncated, truncated), truncated));
+            memcpy(values + col, &bytes, 4);
+        }
+    }
+    return col;
+}
+#endif
+
+/**
+ * Scales every value of a planar row by its vignette scaling factor
+ * @param blue    blue values of the row
+ * @param green   green values of the row
+ * @param red     red values of the row
+ * @param width   number of pixels in the row
+ * @param factors scaling factor of every pixel in the row
+ */
+void vignette_planar(unsigned char* blue, unsigned char* green, unsigned char* red, int width, const double* factors)
+{
+    int col = 0;
+#ifdef X86_KERNELS
+    if (simd_level() >= SIMD_AVX2)
+    {
+        col = vignette_planar_avx2(blue, green, red, width, factors);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        double scaling_factor = factors[col];
+        red[col] = (int)(red[col] * scaling_factor);
+        green[col] = (int)(green[col] * scaling_factor);
+        blue[col] = (int)(blue[col] * scaling_factor);
+    }
+}
+
+/**
+ * Runs one pipeline step in place on a planar row
+ * Helper function for the planar pipelines
+ * @param step   the prepared step, with a vignette map for effect 1
+ * @param planes blue, green and red values of the row
+ * @param row    index of the row in the image
+ * @param width  number of pixels in the row
+ */
+void run_planar_step(const PipelineStep& step, unsigned char* const planes[3], int row, int width)
+{
+    // Local pointers, since stores through unsigned char pointers could
+    // otherwise change any of them
+    unsigned char* blue = planes[0];
+    unsigned char* green = planes[1];
+    unsigned char* red = planes[2];
+    switch (step.number)
+    {
+        case 1: vignette_planar(blue, green, red, width, step.vignette->row_factors(row)); break;
+        case 2:
+        {
+            const ClarendonTables& clarendon = *step.clarendon;
+            for (int col = 0; col < width; col++)
+            {
+                const ToneTable& table = clarendon.tables[clarendon.table_for_sum[blue[col] + green[col] + red[col]]];
+                unsigned char new_blue = table.channel[0][blue[col]];
+                unsigned char new_green = table.channel[1][green[col]];
+                unsigned char new_red = table.channel[2][red[col]];
+                blue[col] = new_blue;
+                green[col] = new_green;
+                red[col] = new_red;
+            }
+            break;
+        }
+        case 3: convert_planar<GRAYSCALE_KERNEL>(planes, width); break;
+        case 7: convert_planar<HIGH_CONTRAST_KERNEL>(planes, width); break;
+        case 8:
+        case 9:
+        {
+            const ToneTable& table = step.tone;
+            for (int col = 0; col < width; col++)
+            {
+                unsigned char new_blue = table.channel[0][blue[col]];
+                unsigned char new_green = table.channel[1][green[col]];
+                unsigned char new_red = table.channel[2][red[col]];
+                blue[col] = new_blue;
+                green[col] = new_green;
+                red[col] = new_red;
+            }
+            break;
+        }
+        case 10: convert_planar<FIVE_COLOR_KERNEL>(planes, width); break;
+    }
+}
+
+/**
+ * Applies a chain of pixel-local effects in place to a planar image, for
+ * callers that keep their images planar between chains
+ * @param image   the planar image
+ * @param effects the effects to apply, in order
+ * @return true if successful and false if an effect is not pixel-local
+ */
+bool apply_pipeline(PlanarImage& image, const vector<Effect>& effects)
+{
+    vector<PipelineStep> steps = prepare_steps(effects, image.width, image.height, true);
+    if (steps.size() != effects.size())
+    {
+        return false;
+    }
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            unsigned char* planes[3] = {image.plane(0, row), image.plane(1, row), image.plane(2, row)};
+            for (const PipelineStep& step : steps)
+            {
+                run_planar_step(step, planes, row, image.width);
+            }
+        }
+    });
+    return true;
+}
+
+// Time a pipeline step takes per pixel, in tenths of a nanosecond, in the
+// interleaved and in the planar layout, measured on one core with the AVX2
+// kernels. Only the channel comparisons of grayscale, high contrast and
+// five color get faster on planes, the table lookups get a little slower.
+const int VIGNETTE_STEP_COST[2] = {15, 15};
+const int CLARENDON_STEP_COST[2] = {10, 10};
+const int CONVERT_STEP_COST[2] = {5, 1};
+const int TONE_STEP_COST[2] = {8, 10};
+// Time per pixel of splitting a row into planes and merging it back
+const int PLANAR_CONVERSION_COST = 6;
+
+/**
+ * Decides whether a pipeline runs faster on planar rows, which pays off
+ * when the time saved by its steps is more than the cost of converting
+ * every row to planes and back
+ * Helper function for apply_pipeline()
+ * @param steps the prepared steps
+ * @return true to run the steps on planar rows, false for interleaved pixels
+ */
+bool prefer_planar(const vector<PipelineStep>& steps)
+{
+    // Without AVX2 the planar conversions and kernels are scalar
+    if (simd_level() < SIMD_AVX2)
+    {
+        return false;
+    }
+    int cost[2] = {0, PLANAR_CONVERSION_COST};
+    for (const PipelineStep& step : steps)
+    {
+        for (int planar = 0; planar < 2; planar++)
+        {
+            switch (step.number)
+            {
+                case 1: cost[planar] += VIGNETTE_STEP_COST[planar]; break;
+                case 2: cost[planar] += CLARENDON_STEP_COST[planar]; break;
+                case 8:
+                case 9: cost[planar] += TONE_STEP_COST[planar]; break;
+                default: cost[planar] += CONVERT_STEP_COST[planar]; break;
+            }
+        }
+    }
+    return cost[1] < cost[0];
+}
+
+/**
+ * Applies a chain of pixel-local effects in order, in a single pass over
+ * the image. Each output row is written by the first effect and then
+ * updated in place by the others while it is still in the cache, so no
+ * intermediate images are made.
+ * @param image   the input image
+ * @param effects the effects to apply, in order
+ * @return the new image, empty if an effect is not pixel-local
+ */
+Image apply_pipeline(const Image& image, const vector<Effect>& effects)
+{
+    if (effects.empty())
+    {
+        return image;
+    }
+    vector<PipelineStep> steps = prepare_steps(effects, image.width, image.height, true);
+    if (steps.empty())
+    {
+        return {};
+    }
+
+    if (image.channels == 3 && prefer_planar(steps))
+    {
+        Image new_image(image.width, image.height);
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            // One planar row per band, split and merged around the steps of each row while it is in the cache
+            PlanarImage scratch(image.width, 1);
+            unsigned char* planes[3] = {scratch.plane(0, 0), scratch.plane(1, 0), scratch.plane(2, 0)};
+            for (int row = first_row; row < last_row; row++)
+            {
+                split_row(image[row], planes, image.width);
+                for (const PipelineStep& step : steps)
+                {
+                    run_planar_step(step, planes, row, image.width);
+                }
+                merge_row(planes, new_image[row], image.width);
+            }
+        });
+        return new_image;
+    }
+
+    return transform_rows(image, [&](auto in, auto out, int row)
+    {
+        run_step(steps[0], in, out, row, image.width, nullptr);
+        for (size_t i = 1; i < steps.size(); i++)
+        {
+            run_step(steps[i], out, out, row, image.width, nullptr);
+        }
+    });
+}
+
+/**
+ * Reads the headers of a BMP file
+ * @param fd   the file descriptor of the file
+ * @param info the layout of the pixels
+ * @return true if the file is a valid image
+ */
+bool read_bmp_info(int fd, BmpInfo& info)
+{
+    unsigned char header[BMP_MASKS_END] = {0};
+    if (!read_all(fd, header, BMP_HEADER_BYTES, 0))
+    {
+        return false;
+    }
+    // The channel masks, if any, are in files of at least BMP_MASKS_END bytes
+    size_t size = read_all(fd, header + BMP_HEADER_BYTES, BMP_MASKS_END - BMP_HEADER_BYTES, BMP_HEADER_BYTES)
+        ? BMP_MASKS_END : BMP_HEADER_BYTES;
+    return parse_bmp_header(header, size, info);
+}
+
+/**
+ * Streaming mode for pixel-local effects. Reads a window of scanlines from
+ * the input file, applies the effects to it and writes it to the output
+ * file before reading the next window, so the memory used depends on the
+ * width of the image and not on its height. The scanlines are processed in
+ * the order they are stored in the file, from bottom to top, or from top to
+ * bottom for top-down files, and the output keeps that order.
+ * @param input   the input BMP filename
+ * @param output  the output BMP filename
+ * @param effects the effects to apply, in order, all pixel-local
+ * @return true if successful and false otherwise
+ */
+bool stream_image(string input, string output, const vector<Effect>& effects)
+{
+    int in_fd = open(input.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+    // Close the files however this function returns
+    shared_ptr<void> close_input(nullptr, [in_fd](void*) { close(in_fd); });
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    BmpInfo info;
+    if (!read_bmp_info(in_fd, info))
+    {
+        return false;
+    }
+    int start = info.start;
+    int width = info.width;
+    int height = info.height;
+    int bytes_per_pixel = info.bytes_per_pixel;
+    int in_row_bytes = info.row_bytes;
+    vector<PipelineStep> steps = prepare_steps(effects, width, height, false);
+    if (steps.empty() && !effects.empty())
+    {
+        return false;
+    }
+
+    string temp;
+    int out_fd = open_output(output, temp, O_WRONLY);
+    if (out_fd < 0)
+    {
+        return false;
+    }
+    bool closed = false;
+    shared_ptr<void> close_output(nullptr, [out_fd, &closed, temp](void*) { if (!closed) finish_output(out_fd, temp, "", false); });
+    unsigned char out_header[BMP_HEADERS_SIZE];
+    // The output keeps the row order of the input, so both are read and
+    // written front to back, in display order for top-down files
+    set_bmp_headers(out_header, width, height, 3, info.top_down);
+    if (!write_all(out_fd, out_header, BMP_HEADERS_SIZE))
+    {
+        return false;
+    }
+
+    // The output rows are processed in place in the window, which 24-bit
+    // input rows are read into directly
+    int scanline_bytes = width * 3;
+    int out_row_bytes = scanline_bytes + (4 - scanline_bytes % 4) % 4;
+    int rows_per_window = max(1, READ_BLOCK_BYTES / max(in_row_bytes, out_row_bytes));
+    vector<unsigned char> window((size_t)min(rows_per_window, height) * out_row_bytes);
+    vector<unsigned char> in_window;
+    if (bytes_per_pixel != 3)
+    {
+        in_window.resize((size_t)min(rows_per_window, height) * in_row_bytes);
+    }
+    bool needs_factors = false;
+    for (const PipelineStep& step : steps)
+    {
+        needs_factors = needs_factors || step.number == 1;
+    }
+
+    for (int first = 0; first < height; first += rows_per_window)
+    {
+        int rows = min(rows_per_window, height - first);
+        off_t offset = start + (off_t)first * in_row_bytes;
+        if (bytes_per_pixel == 3)
+        {
+            if (!read_all(in_fd, window.data(), (size_t)rows * in_row_bytes, offset))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (!read_all(in_fd, in_window.data(), (size_t)rows * in_row_bytes, offset))
+            {
+                return false;
+            }
+            // Keep the blue, green, red values of each pixel
+            for (int r = 0; r < rows; r++)
+            {
+                const unsigned char* pos = in_window.data() + (size_t)r * in_row_bytes;
+                unsigned char* out = window.data() + (size_t)r * out_row_bytes;
+                for (int col = 0; col < width; col++, pos += bytes_per_pixel, out += 3)
+                {
+                    out[0] = pos[0];
+                    out[1] = pos[1];
+                    out[2] = pos[2];
+                }
+            }
+        }
+
+        parallel_rows(rows, width, [&](int first_row, int last_row)
+        {
+            vector<double> factors(needs_factors ? width : 0);
+            for (int r = first_row; r < last_row; r++)
+            {
+                unsigned char* bytes = window.data() + (size_t)r * out_row_bytes;
+                Pixel* pixels = (Pixel*)bytes;
+                // File row first + r is image row height - 1 - (first + r),
+                // or first + r in a top-down file
+                int row = info.top_down ? first + r : height - 1 - (first + r);
+                if (needs_factors)
+                {
+                    vignette_factors(width, height, row, factors.data());
+                }
+                for (const PipelineStep& step : steps)
+                {
+                    run_step(step, pixels, pixels, row, width, factors.data());
+                }
+                memset(bytes + scanline_bytes, 0, out_row_bytes - scanline_bytes);
+            }
+        });
+        if (!write_all(out_fd, window.data(), (size_t)rows * out_row_bytes))
+        {
+            return false;
+        }
+    }
+    closed = true;
+    return finish_output(out_fd, temp, output, true);
+}
+
+// Default memory budget of the out-of-core rotation, in bytes
+const long ROTATE_MEMORY_BUDGET = 256L << 20;
+
+/**
+ * Out-of-core rotation. Rotates a BMP file clockwise by a number of quarter
+ * turns without loading it: the image is read in tiles small enough for
+ * the memory budget, and each rotated tile is written straight to its
+ * place in the output file. Quarter and three-quarter turns use square
+ * tiles, so the reads and the writes both move runs of pixels as long as
+ * the budget allows, and half turns use bands of whole rows.
+ * @param input         the input BMP filename
+ * @param output        the output BMP filename
+ * @param quarter_turns number of clockwise quarter turns, may be negative
+ * @param memory_budget bytes the tiles may use
+ * @return true if successful and false otherwise
+ */
+bool rotate_file(string input, string output, int quarter_turns, long memory_budget)
+{
+    quarter_turns = (quarter_turns % 4 + 4) % 4;
+    if (quarter_turns == 0)
+    {
+        return stream_image(input, output, {});
+    }
+
+    int in_fd = open(input.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+    // Close the files however this function returns
+    shared_ptr<void> close_input(nullptr, [in_fd](void*) { close(in_fd); });
+    BmpInfo info;
+    if (!read_bmp_info(in_fd, info))
+    {
+        return false;
+    }
+    int width = info.width;
+    int height = info.height;
+    int bytes_per_pixel = info.bytes_per_pixel;
+    int new_width = quarter_turns == 2 ? width : height;
+    int new_height = quarter_turns == 2 ? height : width;
+    int out_row_bytes = new_width * 3 + (4 - new_width * 3 % 4) % 4;
+
+    // The input tile, the rotated tile and the row buffer of 32-bit files
+    // must all fit in the budget, row padding included
+    auto tile_bytes = [&](int columns, int rows)
+    {
+        size_t rotated = quarter_turns == 2 ? Image::buffer_size(columns, rows) : Image::buffer_size(rows, columns);
+        size_t row_buffer = bytes_per_pixel == 3 ? 0 : (size_t)columns * bytes_per_pixel;
+        return Image::buffer_size(columns, rows) + rotated + row_buffer;
+    };
+    long tile_pixels = max(1L, memory_budget / (2 * (long)sizeof(Pixel)));
+    int tile_columns;
+    int tile_rows;
+    if (quarter_turns == 2)
+    {
+        tile_columns = width;
+        tile_rows = (int)min<long>(height, max(1L, memory_budget / (2 * Image::row_stride(width))));
+        while (tile_rows > 1 && tile_bytes(tile_columns, tile_rows) > (size_t)memory_budget)
+        {
+            tile_rows--;
+        }
+    }
+    else
+    {
+        int side = max(1, (int)sqrt((double)tile_pixels));
+        while (side > 1 && tile_bytes(min(width, side), min(height, side)) > (size_t)memory_budget)
+        {
+            side--;
+        }
+        tile_columns = min(width, side);
+        tile_rows = min(height, side);
+    }
+
+    string temp;
+    int out_fd = open_output(output, temp, O_RDWR);
+    if (out_fd < 0)
+    {
+        return false;
+    }
+    bool closed = false;
+    shared_ptr<void> close_output(nullptr, [out_fd, &closed, temp](void*) { if (!closed) finish_output(out_fd, temp, "", false); });
+    // Setting the size first leaves the row padding filled with zeros
+    unsigned char headers[BMP_HEADERS_SIZE];
+    set_bmp_headers(headers, new_width, new_height, 3, false);
+    if (ftruncate(out_fd, BMP_HEADERS_SIZE + (off_t)out_row_bytes * new_height) != 0
+        || !write_all(out_fd, headers, BMP_HEADERS_SIZE, 0))
+    {
+        return false;
+    }
+
+    // Both tile buffers are allocated once, and every tile is a view of their top left corner
+    Image tile(tile_columns, tile_rows);
+    Image rotated_tile = quarter_turns == 2 ? Image(tile_columns, tile_rows) : Image(tile_rows, tile_columns);
+    vector<unsigned char> in_row(bytes_per_pixel == 3 ? 0 : (size_t)tile_columns * bytes_per_pixel);
+    // Tiles are visited in the order of the rows of the new image they fill
+    for (int col_start = 0; col_start < width; col_start += tile_columns)
+    {
+        int col_end = min(col_start + tile_columns, width);
+        for (int row_start = 0; row_start < height; row_start += tile_rows)
+        {
+            int row_end = min(row_start + tile_rows, height);
+
+            // Read the tile, a run of pixels from each of its rows
+            Image part = tile;
+            part.width = col_end - col_start;
+            part.height = row_end - row_start;
+            for (int row = row_start; row < row_end; row++)
+            {
+                off_t offset = info.row_offset(row) + (off_t)col_start * bytes_per_pixel;
+                if (bytes_per_pixel == 3)
+                {
+                    if (!read_all(in_fd, (unsigned char*)part[row - row_start], (size_t)part.width * 3, offset))
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                if (!read_all(in_fd, in_row.data(), (size_t)part.width * bytes_per_pixel, offset))
+                {
+                    return false;
+                }
+                Pixel* pixels = part[row - row_start];
+                const unsigned char* pos = in_row.data();
+                for (int col = 0; col < part.width; col++, pos += bytes_per_pixel)
+                {
+                    pixels[col].blue = pos[0];
+                    pixels[col].green = pos[1];
+                    pixels[col].red = pos[2];
+                }
+            }
+
+            // Row j of the rotated tile is part of row first_row + j of the
+            // new image, starting at column first_column
+            Image rotated = rotated_tile;
+            rotated.width = quarter_turns == 2 ? part.width : part.height;
+            rotated.height = quarter_turns == 2 ? part.height : part.width;
+            rotate_into(part, rotated, quarter_turns);
+            int first_row = quarter_turns == 1 ? col_start : quarter_turns == 2 ? height - row_end : width - col_end;
+            int first_column = quarter_turns == 1 ? height - row_end : quarter_turns == 2 ? width - col_end : row_start;
+            for (int j = 0; j < rotated.height; j++)
+            {
+                off_t offset = BMP_HEADERS_SIZE + (off_t)(new_height - 1 - (first_row + j)) * out_row_bytes + (off_t)first_column * 3;
+                if (!write_all(out_fd, (const unsigned char*)rotated[j], (size_t)rotated.width * 3, offset))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    closed = true;
+    return finish_output(out_fd, temp, output, true);
+}
+
+// Measurements of one stage of a job, decoding, an effect or encoding
+struct StageStats
+{
+    string name;
+    double seconds = 0;
+    // Counted on the thread that ran the stage and on the pool workers it used
+    long bytes_read = 0;
+    long bytes_written = 0;
+    long allocations = 0;
+    long allocated_bytes = 0;
+    // Pages read from disk when first touched, as with mapped images
+    long major_faults = 0;
+    // Peak resident memory of the process so far, in kilobytes
+    long peak_rss_kb = 0;
+};
+
+// Measurements of one job, written as one line of the statistics log
+struct JobStats
+{
+    string input;
+    string output;
+    bool success = false;
+    vector<StageStats> stages;
+};
+
+/**
+ * Runs one stage of a job, measuring it if statistics are collected
+ * @param stats the statistics of the job, null if not collected
+ * @param name  name of the stage
+ * @param body  the code of the stage
+ */
+void run_stage(JobStats* stats, string name, const function<void()>& body)
+{
+    if (stats == nullptr)
+    {
+        body();
+        return;
+    }
+    ThreadCounters counters = thread_counters;
+    long major_faults = thread_major_faults();
+    auto begin = chrono::steady_clock::now();
+    body();
+    auto end = chrono::steady_clock::now();
+
+    StageStats stage;
+    stage.name = name;
+    stage.seconds = chrono::duration<double>(end - begin).count();
+    stage.bytes_read = thread_counters.bytes_read - counters.bytes_read;
+    stage.bytes_written = thread_counters.bytes_written - counters.bytes_written;
+    stage.allocations = thread_counters.allocations - counters.allocations;
+    stage.allocated_bytes = thread_counters.allocated_bytes - counters.allocated_bytes;
+    // Faults of the calling thread and of the pool workers that ran bands for it
+    stage.major_faults = thread_major_faults() - major_faults + thread_counters.major_faults - counters.major_faults;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    stage.peak_rss_kb = usage.ru_maxrss;
+    stats->stages.push_back(stage);
+}
+
+/**
+ * Quotes a string for JSON
+ * @param text the string
+ * @return the quoted and escaped string
+ */
+string json_string(string text)
+{
+    string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// Where job statistics are logged, null unless they were asked for
+ostream* stats_log = nullptr;
+mutex stats_log_mutex;
+
+/**
+ * Writes the statistics of a job as one JSON line to the statistics log
+ * @param stats the statistics of the job
+ */
+void log_job_stats(const JobStats& stats)
+{
+    ostringstream line;
+    double total = 0;
+    for (const StageStats& stage : stats.stages)
+    {
+        total += stage.seconds;
+    }
+    line << "{\"input\": " << json_string(stats.input) << ", \"output\": " << json_string(stats.output)
+         << ", \"success\": " << (stats.success ? "true" : "false") << ", \"total_ms\": " << total * 1e3
+         << ", \"stages\": [";
+    for (size_t i = 0; i < stats.stages.size(); i++)
+    {
+        const StageStats& stage = stats.stages[i];
+        line << (i > 0 ? ", " : "") << "{\"stage\": " << json_string(stage.name)
+             << ", \"ms\": " << stage.seconds * 1e3
+             << ", \"bytes_read\": " << stage.bytes_read << ", \"bytes_written\": " << stage.bytes_written
+             << ", \"allocations\": " << stage.allocations << ", \"allocated_bytes\": " << stage.allocated_bytes
+             << ", \"major_faults\": " << stage.major_faults << ", \"peak_rss_kb\": " << stage.peak_rss_kb << "}";
+    }
+    line << "]}" << endl;
+    lock_guard<mutex> lock(stats_log_mutex);
+    *stats_log << line.str() << flush;
+}
+
+/**
+ * Gets the name of an effect, as given on the command line
+ * @param number the process number of the effect
+ * @return the name
+ */
+string effect_name(int number)
+{
+    const char* names[] = {"", "vignette", "clarendon", "grayscale", "rotate90", "rotate", "enlarge",
+                           "high-contrast", "lighten", "darken", "five-color"};
+    return number >= 1 && number <= 10 ? names[number] : "unknown";
+}
+
+/**
+ * Applies a chain of effects in order. Each run of pixel-local effects is
+ * applied as one pipeline, and rotations and enlargements in between are
+ * applied on their own.
+ * @param image   the input image
+ * @param effects the effects to apply, in order
+ * @param stats   the statistics of the job, null if not collected. Each
+ *                pipeline, rotation and enlargement is one stage.
+ * @return the new image, empty if an effect failed
+ */
+Image apply_effects(const Image& image, const vector<Effect>& effects, JobStats* stats = nullptr)
+{
+    Image result = image;
+    vector<Effect> point_effects;
+    // Applies the pixel-local effects seen since the last other effect
+    auto apply_point_effects = [&]()
+    {
+        if (point_effects.empty())
+        {
+            return;
+        }
+        string name;
+        for (const Effect& effect : point_effects)
+        {
+            name += (name.empty() ? "" : "+") + effect_name(effect.number);
+        }
+        run_stage(stats, name, [&]() { result = apply_pipeline(result, point_effects); });
+        point_effects.clear();
+    };
+    for (const Effect& effect : effects)
+    {
+        if (is_point_effect(effect.number))
+        {
+            point_effects.push_back(effect);
+            continue;
+        }
+        apply_point_effects();
+        run_stage(stats, effect_name(effect.number), [&]()
+        {
+            if (effect.number == 4)
+            {
+                result = process_4(result);
+            }
+            else if (effect.number == 5)
+            {
+                result = process_5(result, effect.quarter_turns);
+            }
+            else if (effect.number == 6)
+            {
+                result = process_6(result, effect.x_scale, effect.y_scale);
+            }
+            else
+            {
+                result = {};
+            }
+        });
+        if (result.empty())
+        {
+            return {};
+        }
+    }
+    apply_point_effects();
+    return result;
+}
+
+/**
+ * Parses a number given on the command line
+ * @param text  the argument
+ * @param value the parsed number
+ * @return true if the whole argument is a number
+ */
+bool parse_number(const char* text, double& value)
+{
+    char* end = nullptr;
+    errno = 0;
+    value = strtod(text, &end);
+    return end != text && *end == '\0' && errno == 0;
+}
+
+/**
+ * Parses a whole number given on the command line
+ * @param text  the argument
+ * @param value the parsed number
+ * @return true if the whole argument is a whole number
+ */
+bool parse_number(const char* text, int& value)
+{
+    char* end = nullptr;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    value = (int)parsed;
+    return end != text && *end == '\0' && errno == 0 && parsed == value;
+}
+
+// Number of images that can wait between two stages of a batch
+const int BATCH_QUEUE_SIZE = 16;
+
+// Queue of limited size between two stages of a batch. Producers wait while
+// it is full, so a fast stage cannot run far ahead of a slow one.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    /**
+     * Adds an item, waiting while the queue is full
+     * @param item the item
+     */
+    void push(T item)
+    {
+        unique_lock<mutex> lock(items_mutex);
+        not_full.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(move(item));
+        not_empty.notify_one();
+    }
+
+    /**
+     * Takes the oldest item, waiting while the queue is empty
+     * @param item the item taken
+     * @return false if the queue is closed and empty
+     */
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(items_mutex);
+        not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Wakes up the consumers once no more items will be added
+    void close()
+    {
+        lock_guard<mutex> lock(items_mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    mutex items_mutex;
+    condition_variable not_empty;
+    condition_variable not_full;
+    bool closed = false;
+};
+
+// One image of a batch on its way through the stages
+struct BatchJob
+{
+    string input;
+    string output;
+    Image image;
+    JobStats stats;
+};
+
+/**
+ * Lists the images of a batch
+ * @param source a directory, whose .bmp files are listed in name order, or
+ *               a manifest file with one image filename per line
+ * @param files  the image filenames
+ * @return true if the source could be read
+ */
+bool list_batch_files(string source, vector<string>& files)
+{
+    error_code error;
+    if (filesystem::is_directory(source, error))
+    {
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(source, error))
+        {
+            if (entry.is_regular_file(error) && entry.path().extension() == ".bmp")
+            {
+                files.push_back(entry.path().string());
+            }
+        }
+        sort(files.begin(), files.end());
+        return !error;
+    }
+
+    fstream manifest;
+    manifest.open(source, ios::in);
+    if (!manifest.is_open())
+    {
+        return false;
+    }
+    string line;
+    while (getline(manifest, line))
+    {
+        // Blank lines and comments are skipped
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] != '#')
+        {
+            files.push_back(line);
+        }
+    }
+    return true;
+}
+
+/**
+ * Batch mode. Applies the same effects to many images, writing each result
+ * under its own filename in the output directory. Decoding, processing and
+ * encoding run as separate stages on their own threads, with bounded queues
+ * in between, so the reads and writes of some images overlap with the
+ * effects of others.
+ * @param source     a directory of .bmp files, or a manifest of filenames
+ * @param output_dir directory the results are written to
+ * @param effects    the effects to apply, in order
+ * @param top_down   whether the results are written with their rows from top to bottom
+ * @param keep_alpha whether 32-bit images keep their alpha channel
+ * @return the program exit code
+ */
+int run_batch(string source, string output_dir, const vector<Effect>& effects, bool top_down, bool keep_alpha)
+{
+    vector<string> files;
+    if (!list_batch_files(source, files))
+    {
+        cerr << "Could not list the images in " << source << endl;
+        return 1;
+    }
+    error_code error;
+    filesystem::create_directories(output_dir, error);
+    if (!filesystem::is_directory(output_dir, error))
+    {
+        cerr << "Could not create the directory " << output_dir << endl;
+        return 1;
+    }
+    // Every result is named after its input, so two inputs with the same
+    // filename in different directories would overwrite each other
+    vector<string> outputs;
+    map<string, string> input_of_output;
+    for (const string& file : files)
+    {
+        outputs.push_back((filesystem::path(output_dir) / filesystem::path(file).filename()).string());
+        auto inserted = input_of_output.insert({outputs.back(), file});
+        if (!inserted.second)
+        {
+            cerr << "Both " << inserted.first->second << " and " << file << " would be written to " << outputs.back() << endl;
+            return 1;
+        }
+    }
+
+    BoundedQueue<BatchJob> decoded(BATCH_QUEUE_SIZE);
+    BoundedQueue<BatchJob> processed(BATCH_QUEUE_SIZE);
+    atomic<size_t> next_file{0};
+    atomic<int> failed{0};
+    // Each image is small next to the batch, so the processing stage runs
+    // one image per thread, and a couple of threads keep the disk busy
+    int processors = get_thread_pool()->size();
+    int readers = 2;
+    int writers = 2;
+    // Statistics of a job, null unless they are logged
+    auto stats = [](BatchJob& job) { return stats_log != nullptr ? &job.stats : nullptr; };
+    // Logs the statistics of a job once it is written or has failed
+    auto finish = [](const BatchJob& job)
+    {
+        if (stats_log != nullptr)
+        {
+            log_job_stats(job.stats);
+        }
+    };
+
+    vector<thread> read_threads;
+    for (int i = 0; i < readers; i++)
+    {
+        read_threads.emplace_back([&]()
+        {
+            for (size_t file = next_file++; file < files.size(); file = next_file++)
+            {
+                BatchJob job;
+                job.input = files[file];
+                job.output = outputs[file];
+                job.stats.input = job.input;
+                job.stats.output = job.output;
+                run_stage(stats(job), "decode", [&]() { job.image = read_image(job.input, keep_alpha); });
+                if (job.image.empty())
+                {
+                    cerr << "Could not read " << job.input << endl;
+                    failed++;
+                    finish(job);
+                    continue;
+                }
+                decoded.push(move(job));
+            }
+        });
+    }
+    vector<thread> process_threads;
+    for (int i = 0; i < processors; i++)
+    {
+        process_threads.emplace_back([&]()
+        {
+            BatchJob job;
+            while (decoded.pop(job))
+            {
+                job.image = apply_effects(job.image, effects, stats(job));
+                if (job.image.empty())
+                {
+                    cerr << "Could not apply the effects to " << job.input << endl;
+                    failed++;
+                    finish(job);
+                    continue;
+                }
+                processed.push(move(job));
+            }
+        });
+    }
+    vector<thread> write_threads;
+    for (int i = 0; i < writers; i++)
+    {
+        write_threads.emplace_back([&]()
+        {
+            BatchJob job;
+            while (processed.pop(job))
+            {
+                bool success = false;
+                run_stage(stats(job), "encode", [&]() { success = write_image(job.output, job.image, top_down); });
+                if (!success)
+                {
+                    cerr << "Could not write " << job.output << endl;
+                    failed++;
+                }
+                job.stats.success = success;
+                finish(job);
+                // Free the image before waiting for the next one
+                job.image = {};
+            }
+        });
+    }
+
+    // Each stage ends once the stage before it is done and its queue is empty
+    for (thread& reader : read_threads)
+    {
+        reader.join();
+    }
+    decoded.close();
+    for (thread& processor : process_threads)
+    {
+        processor.join();
+    }
+    processed.close();
+    for (thread& writer : write_threads)
+    {
+        writer.join();
+    }
+    cout << "Processed " << files.size() - failed << " of " << files.size() << " images" << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+// Options of the non-interactive modes
+struct CommandLine
+{
+    // Input and output filenames of a single image
+    string input;
+    string output;
+    // Directory or manifest of the images of a batch, and where their results go
+    string batch;
+    string output_dir;
+    vector<Effect> effects;
+    // Number of threads, 0 if not given
+    int threads = 0;
+    // Whether the single image is streamed a few rows at a time
+    bool stream = false;
+    // Whether the single image is rotated out of core, and the bytes it may use
+    bool out_of_core = false;
+    long memory_budget = ROTATE_MEMORY_BUDGET;
+    // Whether the memory budget was given
+    bool memory = false;
+    // File the statistics of each job are appended to, - for the error stream
+    string stats;
+    // Whether the alpha channel of 32-bit images is kept
+    bool keep_alpha = false;
+    // Whether the output rows are stored from top to bottom
+    bool top_down = false;
+};
+
+/**
+ * Prints the command line options
+ * @param program name the program was run with
+ */
+void print_usage(string program)
+{
+    cout << "Usage: " << program << " -i INPUT.bmp -o OUTPUT.bmp [effects...] [--threads N]" << endl;
+    cout << "       " << program << " --stream -i INPUT.bmp -o OUTPUT.bmp [pixel-local effects...] [--threads N]" << endl;
+    cout << "       " << program << " --out-of-core [--memory MB] -i INPUT.bmp -o OUTPUT.bmp --rotate90|--rotate QUARTER_TURNS" << endl;
+    cout << "       " << program << " --batch DIRECTORY|MANIFEST --output-dir DIRECTORY [effects...] [--threads N]" << endl;
+    cout << "       " << program << " --benchmark [--output RESULTS.json]" << endl;
+    cout << "       " << program << " --verify [--baseline RESULTS.json] [--tolerance PERCENT]" << endl;
+    cout << "       " << program << "    (interactive menu)" << endl;
+    cout << "--stats LOG appends the time, I/O, memory and allocations of every stage of each job" << endl;
+    cout << "to LOG as one JSON line per image, or writes them to the error stream if LOG is -" << endl;
+    cout << "--keep-alpha keeps the alpha channel of 32-bit images, and --top-down writes the rows" << endl;
+    cout << "from top to bottom, for single images and batches only" << endl;
+    cout << "Effects are applied in the order given:" << endl;
+    cout << "  --vignette" << endl;
+    cout << "  --clarendon SCALE" << endl;
+    cout << "  --grayscale" << endl;
+    cout << "  --rotate90" << endl;
+    cout << "  --rotate QUARTER_TURNS" << endl;
+    cout << "  --enlarge X_SCALE Y_SCALE" << endl;
+    cout << "  --high-contrast" << endl;
+    cout << "  --lighten SCALE" << endl;
+    cout << "  --darken SCALE" << endl;
+    cout << "  --five-color" << endl;
+}
+
+/**
+ * Parses the effect chain and options of the non-interactive modes
+ * @param argc    number of arguments
+ * @param argv    the arguments
+ * @param options the parsed options
+ * @return true if the arguments are valid
+ */
+bool parse_arguments(int argc, char* argv[], CommandLine& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        // Number of values the option takes
+        int values = 0;
+        if (option == "-i" || option == "-o" || option == "--batch" || option == "--output-dir"
+            || option == "--clarendon" || option == "--rotate" || option == "--lighten" || option == "--darken"
+            || option == "--threads" || option == "--memory" || option == "--stats")
+        {
+            values = 1;
+        }
+        else if (option == "--enlarge")
+        {
+            values = 2;
+        }
+        if (i + values >= argc && values > 0)
+        {
+            cerr << option << " needs " << values << " value" << (values > 1 ? "s" : "") << endl;
+            return false;
+        }
+
+        Effect effect = {0, 0};
+        if (option == "-i")
+        {
+            options.input = argv[++i];
+            continue;
+        }
+        else if (option == "-o")
+        {
+            options.output = argv[++i];
+            continue;
+        }
+        else if (option == "--batch")
+        {
+            options.batch = argv[++i];
+            continue;
+        }
+        else if (option == "--output-dir")
+        {
+            options.output_dir = argv[++i];
+            continue;
+        }
+        else if (option == "--stream")
+        {
+            options.stream = true;
+            continue;
+        }
+        else if (option == "--stats")
+        {
+            options.stats = argv[++i];
+            continue;
+        }
+        else if (option == "--keep-alpha")
+        {
+            options.keep_alpha = true;
+            continue;
+        }
+        else if (option == "--top-down")
+        {
+            options.top_down = true;
+            continue;
+        }
+        else if (option == "--out-of-core")
+        {
+            options.out_of_core = true;
+            continue;
+        }
+        else if (option == "--memory")
+        {
+            int megabytes = 0;
+            if (!parse_number(argv[++i], megabytes) || megabytes < 1)
+            {
+                cerr << "--memory needs a positive whole number of megabytes" << endl;
+                return false;
+            }
+            options.memory_budget = (long)megabytes << 20;
+            options.memory = true;
+            continue;
+        }
+        else if (option == "--threads")
+        {
+            if (!parse_number(argv[++i], options.threads) || options.threads < 1)
+            {
+                cerr << "--threads needs a positive whole number" << endl;
+                return false;
+            }
+            continue;
+        }
+        else if (option == "--vignette")
+        {
+            effect.number = 1;
+        }
+        else if (option == "--clarendon" || option == "--lighten" || option == "--darken")
+        {
+            effect.number = option == "--clarendon" ? 2 : option == "--lighten" ? 8 : 9;
+            if (!parse_number(argv[++i], effect.scaling_factor))
+            {
+                cerr << option << " needs a number" << endl;
+                return false;
+            }
+        }
+        else if (option == "--grayscale")
+        {
+            effect.number = 3;
+        }
+        else if (option == "--rotate90")
+        {
+            effect.number = 4;
+        }
+        else if (option == "--rotate")
+        {
+            effect.number = 5;
+            if (!parse_number(argv[++i], effect.quarter_turns))
+            {
+                cerr << "--rotate needs a whole number of quarter turns" << endl;
+                return false;
+            }
+        }
+        else if (option == "--enlarge")
+        {
+            effect.number = 6;
+            if (!parse_number(argv[i + 1], effect.x_scale) || !parse_number(argv[i + 2], effect.y_scale)
+                || effect.x_scale < 1 || effect.y_scale < 1)
+            {
+                cerr << "--enlarge needs two positive whole scales" << endl;
+                return false;
+            }
+            i += 2;
+        }
+        else if (option == "--high-contrast")
+        {
+            effect.number = 7;
+        }
+        else if (option == "--five-color")
+        {
+            effect.number = 10;
+        }
+        else
+        {
+            cerr << "Unknown option " << option << endl;
+            return false;
+        }
+        options.effects.push_back(effect);
+    }
+    if (!options.batch.empty())
+    {
+        if (options.output_dir.empty() || !options.input.empty() || !options.output.empty())
+        {
+            cerr << "A batch needs an output directory (--output-dir) and no -i or -o" << endl;
+            return false;
+        }
+        if (options.stream || options.out_of_core)
+        {
+            cerr << "--stream and --out-of-core work with single images, not with --batch" << endl;
+            return false;
+        }
+    }
+    else if (options.input.empty() || options.output.empty())
+    {
+        cerr << "Both an input (-i) and an output (-o) filename are needed" << endl;
+        return false;
+    }
+    if (options.memory && !options.out_of_core)
+    {
+        cerr << "--memory sets the budget of --out-of-core and needs it" << endl;
+        return false;
+    }
+    if (options.stream && options.out_of_core)
+    {
+        cerr << "--stream and --out-of-core cannot be combined" << endl;
+        return false;
+    }
+    if (options.out_of_core && (options.effects.size() != 1 || (options.effects[0].number != 4 && options.effects[0].number != 5)))
+    {
+        cerr << "An out-of-core run takes a single rotation" << endl;
+        return false;
+    }
+    if ((options.stream || options.out_of_core) && options.top_down)
+    {
+        cerr << "--top-down works with single images and batches, not with --stream or --out-of-core" << endl;
+        return false;
+    }
+    if ((options.stream || options.out_of_core) && options.keep_alpha)
+    {
+        cerr << "--keep-alpha works with single images and batches, not with --stream or --out-of-core" << endl;
+        return false;
+    }
+    if (options.stream)
+    {
+        for (const Effect& effect : options.effects)
+        {
+            if (!is_point_effect(effect.number))
+            {
+                cerr << "Only pixel-local effects can be streamed, not rotations or enlargements" << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Options of the benchmark and verify modes
+struct ToolOptions
+{
+    // File the benchmark results are written to, none if empty
+    string output;
+    // Benchmark results the throughput is checked against, none if empty,
+    // and the percentage of their throughput that may be lost
+    string baseline;
+    double tolerance = 10;
+};
+
+/**
+ * Parses the options of the benchmark and verify modes, which follow the
+ * mode itself
+ * @param argc    number of arguments
+ * @param argv    the arguments, the mode first
+ * @param options the parsed options
+ * @return true if the arguments are valid for the mode
+ */
+bool parse_tool_arguments(int argc, char* argv[], ToolOptions& options)
+{
+    string mode = argv[1];
+    for (int i = 2; i < argc; i++)
+    {
+        string option = argv[i];
+        bool known = mode == "--verify" ? option == "--baseline" || option == "--tolerance" : option == "--output";
+        if (!known)
+        {
+            cerr << "Unknown option " << option << " for " << mode << endl;
+            return false;
+        }
+        if (i + 1 >= argc)
+        {
+            cerr << option << " needs 1 value" << endl;
+            return false;
+        }
+        if (option == "--output")
+        {
+            options.output = argv[++i];
+        }
+        else if (option == "--baseline")
+        {
+            options.baseline = argv[++i];
+        }
+        else if (!parse_number(argv[++i], options.tolerance) || !(options.tolerance >= 0))
+        {
+            cerr << "--tolerance needs a percentage of zero or more" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs the single image job of the non-interactive modes
+ * Helper function for run_command_line()
+ * @param options the command line options
+ * @param stats   the statistics of the job, null if not collected
+ * @return the program exit code
+ */
+int run_job(const CommandLine& options, JobStats* stats)
+{
+    bool success = false;
+    if (options.out_of_core)
+    {
+        const Effect& rotation = options.effects[0];
+        int quarter_turns = rotation.number == 4 ? 1 : rotation.quarter_turns;
+        run_stage(stats, "rotate_file", [&]()
+        {
+            success = rotate_file(options.input, options.output, quarter_turns, options.memory_budget);
+        });
+        if (!success)
+        {
+            cerr << "Could not rotate " << options.input << " to " << options.output << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (options.stream)
+    {
+        run_stage(stats, "stream", [&]() { success = stream_image(options.input, options.output, options.effects); });
+        if (!success)
+        {
+            cerr << "Could not stream " << options.input << " to " << options.output << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    Image image;
+    run_stage(stats, "decode", [&]()
+    {
+        image = options.keep_alpha ? read_image(options.input, true) : map_image(options.input);
+        // With statistics, the time and faults of reading a mapped file
+        // belong to the decode stage, not to the first effect
+        if (stats != nullptr && !image.empty())
+        {
+            fault_in(image);
+        }
+    });
+    if (image.empty())
+    {
+        cerr << "Could not read " << options.input << endl;
+        return 1;
+    }
+    Image new_image = apply_effects(image, options.effects, stats);
+    if (new_image.empty())
+    {
+        cerr << "Could not apply the effects to " << options.input << endl;
+        return 1;
+    }
+    run_stage(stats, "encode", [&]() { success = write_image(options.output, new_image, options.top_down); });
+    if (!success)
+    {
+        cerr << "Could not write " << options.output << endl;
+        return 1;
+    }
+    return 0;
 }
 
 /**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Non-interactive modes. Reads one image, or each image of a batch,
+ * applies the effects given on the command line in order and writes the
+ * result, for use from scripts.
+ * @param argc number of arguments
+ * @param argv the arguments
+ * @return the program exit code
  */
-vector<vector<Pixel>> read_image(string filename)
+int run_command_line(int argc, char* argv[])
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
-
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
-
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
+    if (argc == 2 && (string(argv[1]) == "-h" || string(argv[1]) == "--help"))
     {
-        padding = 4 - scanline_size % 4;
+        print_usage(argv[0]);
+        return 0;
     }
-
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+    CommandLine options;
+    if (!parse_arguments(argc, argv, options))
     {
-        return {};
+        print_usage(argv[0]);
+        return 2;
     }
-
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
-
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+    if (options.threads > 0)
+    {
+        set_thread_count(options.threads);
+    }
+    fstream stats_file;
+    if (options.stats == "-")
+    {
+        stats_log = &cerr;
+    }
+    else if (!options.stats.empty())
     {
-        // For each column
-        for (int j = 0; j < width; j++)
+        stats_file.open(options.stats, ios::out | ios::app);
+        if (!stats_file.is_open())
         {
-            // Go to the pixel position
-            stream.seekg(pos);
-
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
-
-            // We are ignoring the alpha channel if there is one
-
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
+            cerr << "Could not open " << options.stats << endl;
+            return 1;
         }
+        stats_log = &stats_file;
+    }
+    if (!options.batch.empty())
+    {
+        return run_batch(options.batch, options.output_dir, options.effects, options.top_down, options.keep_alpha);
+    }
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
+    JobStats job;
+    job.input = options.input;
+    job.output = options.output;
+    JobStats* stats = stats_log != nullptr ? &job : nullptr;
+    int status = run_job(options, stats);
+    job.success = status == 0;
+    if (stats != nullptr)
+    {
+        log_job_stats(job);
     }
+    return status;
+}
 
-    // Close the stream and return the image vector
-    stream.close();
+/**
+ * Creates a synthetic test image with a smooth color pattern
+ * Helper function for the benchmarks
+ * @param width  width of the image in pixels
+ * @param height height of the image in pixels
+ * @return the generated image
+ */
+Image make_test_image(int width, int height)
+{
+    Image image(width, height);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            image[row][col].red = (col * 7 + row) % 256;
+            image[row][col].green = (row * 5 + col * 3) % 256;
+            image[row][col].blue = (col ^ row) % 256;
+        }
+    }
     return image;
 }
 
 /**
- * Sets a value to the char array starting at the offset using the size
- * specified by the bytes.
- * This is a helper function for write_image()
- * @param arr    Array to set values for
- * @param offset Starting index offset
- * @param bytes  Number of bytes to set
- * @param value  Value to set
- * @return nothing
+ * Creates a synthetic test image of random noise, whose pixels have no
+ * pattern a branch predictor could learn
+ * Helper function for the benchmarks
+ * @param width  width of the image in pixels
+ * @param height height of the image in pixels
+ * @return the generated image
  */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+Image make_noise_image(int width, int height)
 {
-    for (int i = 0; i < bytes; i++)
+    Image image(width, height);
+    unsigned int state = 2463534242u;
+    for (int row = 0; row < height; row++)
     {
-        arr[offset+i] = (unsigned char)(value>>(i*8));
+        for (int col = 0; col < width; col++)
+        {
+            // Xorshift random numbers
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            image[row][col].red = state;
+            image[row][col].green = state >> 8;
+            image[row][col].blue = state >> 16;
+        }
     }
+    return image;
 }
 
 /**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
+ * Creates a four channel test image: the noise of make_noise_image() with
+ * an alpha channel of diagonal stripes
+ * Helper function for run_verify()
+ * @param width  width of the image in pixels
+ * @param height height of the image in pixels
+ * @return the generated image
  */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+Image make_alpha_image(int width, int height)
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
-    // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
-    int padding_bytes = 0;
-    padding_bytes = (4 - width_bytes % 4) % 4;
-    width_bytes = width_bytes + padding_bytes;
-
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
-
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
-
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
+    Image noise = make_noise_image(width, height);
+    Image image(width, height, 4);
+    for (int row = 0; row < height; row++)
     {
-        return false;
+        for (int col = 0; col < width; col++)
+        {
+            PixelBGRA& pixel = image.bgra(row)[col];
+            pixel.blue = noise[row][col].blue;
+            pixel.green = noise[row][col].green;
+            pixel.red = noise[row][col].red;
+            pixel.alpha = (col * 11 + row * 13) % 256;
+        }
     }
+    return image;
+}
 
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
-
-    // BMP Header
-    set_bytes(bmp_header,  0, 1, 'B');              // ID field
-    set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
-    set_bytes(bmp_header,  6, 2, 0);                // Reserved
-    set_bytes(bmp_header,  8, 2, 0);                // Reserved
-    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+// Timing of one benchmark, one line of the JSON report
+struct BenchmarkResult
+{
+    string name;
+    // The image it ran on
+    string image;
+    int width = 0;
+    int height = 0;
+    int runs = 0;
+    // Fastest run, in seconds
+    double best = 0;
+    // Heap allocations per run, and their bytes
+    long allocations = 0;
+    long allocated_bytes = 0;
+};
 
-    // DIB Header
-    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
-    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
-    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
-    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
-    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
-    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
-    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
-    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+/**
+ * Times a benchmark body and counts its allocations
+ * Helper function for run_benchmark()
+ * @param name   name of the benchmark
+ * @param image  the image it runs on, for the throughput
+ * @param label  name of the image
+ * @param runs   number of timed runs, the fastest one is reported
+ * @param body   the code to time
+ * @return the measurements
+ */
+BenchmarkResult time_benchmark(string name, const Image& image, string label, int runs, const function<void()>& body)
+{
+    BenchmarkResult result;
+    result.name = name;
+    result.image = label;
+    result.width = image.width;
+    result.height = image.height;
+    result.runs = runs;
+    result.best = 1e30;
+    long count = allocation_count;
+    long bytes = allocation_bytes;
+    for (int run = 0; run < runs; run++)
+    {
+        auto begin = chrono::steady_clock::now();
+        body();
+        auto end = chrono::steady_clock::now();
+        result.best = min(result.best, chrono::duration<double>(end - begin).count());
+    }
+    result.allocations = (allocation_count - count) / runs;
+    result.allocated_bytes = (allocation_bytes - bytes) / runs;
+    cerr << name << " " << label << ": " << result.best * 1e3 << " ms" << endl;
+    return result;
+}
 
-    // Write the BMP and DIB Headers to the file
-    stream.write((char*)bmp_header, sizeof(bmp_header));
-    stream.write((char*)dib_header, sizeof(dib_header));
+/**
+ * Writes the benchmark results as a JSON document
+ * Helper function for run_benchmark()
+ * @param stream  where to write
+ * @param results the results
+ */
+void write_benchmark_json(ostream& stream, const vector<BenchmarkResult>& results)
+{
+    const char* levels[] = {"none", "sse2", "avx2", "avx512"};
+    stream << "{" << endl;
+    stream << "  \"simd\": \"" << levels[simd_level()] << "\"," << endl;
+    stream << "  \"threads\": " << get_thread_pool()->size() << "," << endl;
+    stream << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& result = results[i];
+        double pixels = (double)result.width * result.height;
+        stream << "    {\"benchmark\": \"" << result.name << "\", \"image\": \"" << result.image << "\""
+               << ", \"width\": " << result.width << ", \"height\": " << result.height
+               << ", \"runs\": " << result.runs << ", \"best_ms\": " << result.best * 1e3
+               << ", \"megapixels_per_second\": " << pixels / 1e6 / result.best
+               << ", \"ns_per_pixel\": " << result.best * 1e9 / pixels
+               << ", \"allocations\": " << result.allocations
+               << ", \"allocated_bytes\": " << result.allocated_bytes << "}"
+               << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    stream << "  ]" << endl;
+    stream << "}" << endl;
+}
 
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
+/**
+ * Benchmarks the BMP codec and every effect on the bundled sample and on
+ * synthetic images of 1, 12 and 50 megapixels. Progress goes to the error
+ * stream.
+ * @param results the measurements
+ * @return true if successful and false otherwise
+ */
+bool run_benchmarks(vector<BenchmarkResult>& results)
+{
+    string filename = "benchmark_synthetic.bmp";
+    struct Case
+    {
+        string label;
+        Image image;
+    };
+    vector<Case> cases;
+    cases.push_back({"sample2.bmp", read_image("sample2.bmp")});
+    const int sizes[][2] = {{1000, 1000}, {4000, 3000}, {10000, 5000}};
+    for (auto& size : sizes)
+    {
+        cases.push_back({to_string(size[0]) + "x" + to_string(size[1]), make_test_image(size[0], size[1])});
+    }
 
-    // Pixel Array (Left to right, bottom to top, with padding)
-    for (int h = height_pixels - 1; h >= 0; h--)
+    const vector<Effect> chain = {{3, 0}, {7, 0}, {10, 0}};
+    for (Case& test : cases)
     {
-        for (int w = 0; w < width_pixels; w++)
+        const Image& image = test.image;
+        if (image.empty())
         {
-            // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
+            cerr << "Could not read " << test.label << endl;
+            return false;
         }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
+        // Around 100 MP of work per benchmark, and at least 3 runs
+        int runs = (int)max(3L, min(20L, 100000000L / ((long)image.width * image.height)));
+        results.push_back(time_benchmark("write_image", image, test.label, runs, [&]() { write_image(filename, image); }));
+        results.push_back(time_benchmark("read_image", image, test.label, runs, [&]() { read_image(filename); }));
+        results.push_back(time_benchmark("process_1", image, test.label, runs, [&]() { process_1(image); }));
+        results.push_back(time_benchmark("process_2", image, test.label, runs, [&]() { process_2(image, 0.3); }));
+        results.push_back(time_benchmark("process_3", image, test.label, runs, [&]() { process_3(image); }));
+        results.push_back(time_benchmark("process_4", image, test.label, runs, [&]() { process_4(image); }));
+        results.push_back(time_benchmark("process_5", image, test.label, runs, [&]() { process_5(image, 2); }));
+        results.push_back(time_benchmark("process_6", image, test.label, runs, [&]() { process_6(image, 2, 2); }));
+        results.push_back(time_benchmark("process_7", image, test.label, runs, [&]() { process_7(image); }));
+        results.push_back(time_benchmark("process_8", image, test.label, runs, [&]() { process_8(image, 0.5); }));
+        results.push_back(time_benchmark("process_9", image, test.label, runs, [&]() { process_9(image, 0.5); }));
+        results.push_back(time_benchmark("process_10", image, test.label, runs, [&]() { process_10(image); }));
+        PlanarImage planar = to_planar(image);
+        results.push_back(time_benchmark("to_planar", image, test.label, runs, [&]() { to_planar(image); }));
+        results.push_back(time_benchmark("to_interleaved", image, test.label, runs, [&]() { to_interleaved(planar); }));
+        // A chain of channel comparisons, which apply_pipeline() runs on planar rows
+        results.push_back(time_benchmark("pipeline_3_7_10", image, test.label, runs, [&]() { apply_pipeline(image, chain); }));
+        test.image = {};
     }
+    remove(filename.c_str());
 
-    // Close the stream and return true
-    stream.close();
+    // The five color filter should run as fast on noise as on smooth
+    // images, since none of its branches depend on the pixel values
+    Image noise = make_noise_image(4000, 3000);
+    results.push_back(time_benchmark("process_10", noise, "4000x3000 noise", 5, [&]() { process_10(noise); }));
     return true;
 }
 
-// PROCESS 1 - Adds vignette effect - dark corners
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+/**
+ * Runs the benchmarks and writes the results as JSON
+ * @param output file the JSON is written to, the standard output if empty
+ * @return the program exit code
+ */
+int run_benchmark(string output)
 {
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
+    vector<BenchmarkResult> results;
+    if (!run_benchmarks(results))
     {
-        for (int col = 0; col < num_columns; col++)
-        {
-            //find the distance from each cell to the center and calculate scaling factor
-            double distance = sqrt(pow(col - num_columns/2,2) + pow(row - num_rows/2,2));
-            double scaling_factor = (num_rows - distance)/num_rows;
-            int newred = image[row][col].red*scaling_factor;
-            int newgreen = image[row][col].green*scaling_factor;
-            int newblue = image[row][col].blue*scaling_factor;
-            //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
-        }
+        return 1;
     }
-    return new_image;
-}
-// PROCESS 2 - Adds clarendon type effect - darks darker and lights lighter
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
-    {
-        for (int col = 0; col < num_columns; col++)
-        {
-            //What are the red, blue and green values for current cell? Obtain the info and calculate the average
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-            double average_value = (red_value + green_value + blue_value)/3;
-            //If the cell is light, make it lighter
-            if (average_value >= 170)
-            {
-                int new_red = 255 - (255 - red_value)* scaling_factor;
-                int new_green = 255 - (255 - green_value)* scaling_factor;
-                int new_blue = 255 - (255 - blue_value)* scaling_factor;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-            //If the cell is dark, make it darker
-            else if (average_value < 90)
-            {
-                int new_red = red_value* scaling_factor;
-                int new_green = green_value* scaling_factor;
-                int new_blue = blue_value* scaling_factor;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-            else
-            {
-                int new_red = red_value;
-                int new_green = green_value;
-                int new_blue = blue_value;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-        }
+    if (output.empty())
+    {
+        write_benchmark_json(cout, results);
+        return 0;
     }
-    return new_image;
+    fstream stream;
+    stream.open(output, ios::out | ios::trunc);
+    if (!stream.is_open())
+    {
+        cerr << "Could not write " << output << endl;
+        return 1;
+    }
+    write_benchmark_json(stream, results);
+    return 0;
 }
 
-//PROCESS 3 - Greyscale
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+/**
+ * Hashes the size and the pixels of an image with 64-bit FNV-1a, to compare
+ * it with a golden image. Alpha values are hashed after the color values
+ * of their pixel.
+ * @param image the image
+ * @return the hash
+ */
+unsigned long long image_hash(const Image& image)
 {
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    auto add = [&hash](unsigned char byte)
+    {
+        hash = (hash ^ byte) * 0x100000001b3ULL;
+    };
+    for (int i = 0; i < 4; i++)
+    {
+        add(image.width >> (8 * i));
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        add(image.height >> (8 * i));
+    }
+    for (int row = 0; row < image.height; row++)
     {
-        for (int col = 0; col < num_columns; col++)
+        const unsigned char* bytes = image.row_bytes(row);
+        for (int i = 0; i < image.width * image.channels; i++)
         {
-            //Obtaining the red, blue and green values for current cell in original image 
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-            double gray_value = (red_value + green_value + blue_value)/3;
-            //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-            new_image[row][col].red = gray_value;
-            new_image[row][col].green = gray_value;
-            new_image[row][col].blue = gray_value;
+            add(bytes[i]);
         }
     }
-    return new_image;
+    return hash;
 }
 
-//PROCESS 4 - Rotate by 90 degrees
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+// Hash of the output of an effect on a test image, as computed by the
+// original, unoptimized version of each effect
+struct GoldenHash
+{
+    const char* image;
+    const char* output;
+    unsigned long long hash;
+};
+
+// Outputs checked by --verify. The effects and pipelines use the parameters
+// in golden_output(), "input" is the test image itself, and the top_down
+// outputs are the test image written to a top-down file and decoded again.
+const GoldenHash GOLDEN_HASHES[] =
+{
+    {"sample2.bmp", "input", 0x518445843a7ff21cULL},
+    {"sample2.bmp", "process_1", 0x3d8cfd7dc7301854ULL},
+    {"sample2.bmp", "process_2", 0xf703014641bb70baULL},
+    {"sample2.bmp", "process_3", 0x8792bb83c85ae7e7ULL},
+    {"sample2.bmp", "process_4", 0xfff62ee60317ad1cULL},
+    {"sample2.bmp", "process_5", 0xc0ffc6c5f95e5e4eULL},
+    {"sample2.bmp", "process_6", 0x6799d9473b3e4e00ULL},
+    {"sample2.bmp", "process_7", 0x427a0d62950bfbdcULL},
+    {"sample2.bmp", "process_8", 0xe010c3fa8e2d0827ULL},
+    {"sample2.bmp", "process_9", 0x64c25e6740234dccULL},
+    {"sample2.bmp", "process_10", 0xef4a0af86584f8f0ULL},
+    {"sample2.bmp", "pipeline_fused", 0x5d36e2d6f49b2781ULL},
+    {"sample2.bmp", "pipeline_planar", 0x44a7b2186a7bc66dULL},
+    {"sample2.bmp", "pipeline_mixed", 0xc768aeeb9d3fe36fULL},
+    {"sample2.bmp", "top_down_read", 0x518445843a7ff21cULL},
+    {"sample2.bmp", "top_down_map", 0x518445843a7ff21cULL},
+    {"257x131", "input", 0xb8a89f7b99c073c5ULL},
+    {"257x131", "process_1", 0x7aaa0e4b0bf5be8bULL},
+    {"257x131", "process_2", 0x3b70fa6801245ce2ULL},
+    {"257x131", "process_3", 0x62344f8a63171f46ULL},
+    {"257x131", "process_4", 0x06d12126f275b091ULL},
+    {"257x131", "process_5", 0x03ac14eaf2475591ULL},
+    {"257x131", "process_6", 0xa6a88ad3cb1a82e9ULL},
+    {"257x131", "process_7", 0x92f43ff4e316ca8eULL},
+    {"257x131", "process_8", 0x5d071d11f05b8a31ULL},
+    {"257x131", "process_9", 0xffc3d46651d99bbbULL},
+    {"257x131", "process_10", 0xa3fb21722d840981ULL},
+    {"300x200 noise", "input", 0x994e489735e1a1a3ULL},
+    {"300x200 noise", "process_1", 0x03bb59f9df97a55fULL},
+    {"300x200 noise", "process_2", 0x537f868abed48073ULL},
+    {"300x200 noise", "process_3", 0xa4b9f398678837c6ULL},
+    {"300x200 noise", "process_4", 0x11d0f22bf0b6f9b3ULL},
+    {"300x200 noise", "process_5", 0xfff4bf6841915cc9ULL},
+    {"300x200 noise", "process_6", 0x851c816581ab1b47ULL},
+    {"300x200 noise", "process_7", 0xddb44d4d16e59820ULL},
+    {"300x200 noise", "process_8", 0x17350b2334ec000dULL},
+    {"300x200 noise", "process_9", 0x47ac126870623344ULL},
+    {"300x200 noise", "process_10", 0x0b5dc9b4009119bfULL},
+    // Large enough to be split into several bands when there are several threads
+    {"1200x800 noise", "input", 0x4d276c40433d07d5ULL},
+    {"1200x800 noise", "process_1", 0x59fd8efc09feb562ULL},
+    {"1200x800 noise", "process_2", 0x00d83b1bf03d0aa1ULL},
+    {"1200x800 noise", "process_3", 0x959d9a7bbd32397bULL},
+    {"1200x800 noise", "process_4", 0xc40709610f201d81ULL},
+    {"1200x800 noise", "process_5", 0x526ab1af14a6bc73ULL},
+    {"1200x800 noise", "process_6", 0xb29a35a394ccb047ULL},
+    {"1200x800 noise", "process_7", 0xb578d6d6fb154c79ULL},
+    {"1200x800 noise", "process_8", 0x37e2604977cfd1beULL},
+    {"1200x800 noise", "process_9", 0x575698471681ead3ULL},
+    {"1200x800 noise", "process_10", 0x566213c3778bf71fULL},
+    {"1200x800 noise", "pipeline_fused", 0xcc728ddd84167aeaULL},
+    {"1200x800 noise", "pipeline_planar", 0x0b568b98b293fba7ULL},
+    {"1200x800 noise", "pipeline_mixed", 0x72a70b19c37cbd53ULL},
+    {"1200x800 noise", "top_down_read", 0x4d276c40433d07d5ULL},
+    {"1200x800 noise", "top_down_map", 0x4d276c40433d07d5ULL},
+    // The original effects on the color values, with the alpha values
+    // unchanged by the pixel-local effects and moved by the others as if
+    // they were a gray image of their own
+    {"300x200 noise alpha", "input", 0x0f2253eb46ef5a29ULL},
+    {"300x200 noise alpha", "process_1", 0x06535544812be00bULL},
+    {"300x200 noise alpha", "process_2", 0xcdacc6ce4b806dd9ULL},
+    {"300x200 noise alpha", "process_3", 0x0fc6f9ce843ac6d8ULL},
+    {"300x200 noise alpha", "process_4", 0xc8493d14b8006849ULL},
+    {"300x200 noise alpha", "process_5", 0x1933ebc633a90a79ULL},
+    {"300x200 noise alpha", "process_6", 0x78c30bac63ae65c9ULL},
+    {"300x200 noise alpha", "process_7", 0x37cd942420fe9296ULL},
+    {"300x200 noise alpha", "process_8", 0x5faec5ef81a38869ULL},
+    {"300x200 noise alpha", "process_9", 0xac9bf65bc04510deULL},
+    {"300x200 noise alpha", "process_10", 0x274c347ab5afe2c5ULL},
+    {"300x200 noise alpha", "pipeline_fused", 0xb64f3909472f19b8ULL},
+    {"300x200 noise alpha", "pipeline_planar", 0x99e2febc20278b7bULL},
+    {"300x200 noise alpha", "pipeline_mixed", 0x9755bf631052f1f1ULL},
+    {"300x200 noise alpha", "top_down_read", 0x0f2253eb46ef5a29ULL},
+};
+
+/**
+ * Computes one of the outputs checked against the golden hashes
+ * Helper function for run_verify()
+ * @param output name of the output
+ * @param image  the test image
+ * @return the output image
+ */
+Image golden_output(string output, const Image& image)
 {
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows)); //define a new 2D vector with the Pixel values and set it to have the rows as number of columns and columns as the number or rows of the original image. 
-    for (int row = 0; row < num_rows; row++)
+    if (output == "process_1") return process_1(image);
+    if (output == "process_2") return process_2(image, 0.3);
+    if (output == "process_3") return process_3(image);
+    if (output == "process_4") return process_4(image);
+    if (output == "process_5") return process_5(image, 2);
+    if (output == "process_6") return process_6(image, 2, 3);
+    if (output == "process_7") return process_7(image);
+    if (output == "process_8") return process_8(image, 0.5);
+    if (output == "process_9") return process_9(image, 0.5);
+    if (output == "process_10") return process_10(image);
+    // Point effects only, fused in one pass over interleaved pixels
+    if (output == "pipeline_fused") return apply_effects(image, {{1, 0}, {2, 0.3}, {8, 0.5}, {9, 0.5}});
+    // Point effects that apply_pipeline() runs on planar rows with the AVX2 kernels
+    if (output == "pipeline_planar") return apply_effects(image, {{1, 0}, {10, 0}, {3, 0}});
+    // Point effect stages between rotations and an enlargement
+    if (output == "pipeline_mixed")
+    {
+        return apply_effects(image, {{2, 0.3}, {4, 0}, {8, 0.5}, {6, 0, 0, 2, 1}, {10, 0}, {5, 0, 3}});
+    }
+    if (output == "top_down_read" || output == "top_down_map")
     {
-        for (int col = 0; col < num_columns; col++)
+        string filename = "verify_top_down.bmp";
+        if (!write_image(filename, image, true))
         {
-            //Calculate the new row and new column when the image is rotated by 90 degrees
-            int new_col = num_rows - row - 1;
-            int new_row = col;
-            //Obtain are the Pixel values for current cell & assign them to the corresponding cell located at new row and new column in the 90-degree rotated 2D vector
-            new_image[new_row][new_col] = image[row][col];
+            return {};
         }
+        Image decoded = output == "top_down_map" ? map_image(filename) : read_image(filename, image.channels == 4);
+        remove(filename.c_str());
+        return decoded;
     }
-    return new_image;
+    return image;
 }
 
-//PROCESS 5 - Rotate by multiples of 90 degrees
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
-{
-    int angle = number*90;
-    vector<vector<Pixel>> new_image;
-    //take the angle and divide it by 360 to get the remainder, rotate 0 time if remainder is 0
-    if (angle%360 == 0) {new_image = image;}
-    //take the angle and divide it by 360 to get the remainder, rotate 1 time if remainder is 90
-    else if (angle%360 == 90) {new_image = process_4(image);}
-    //take the angle and divide it by 360 to get the remainder, rotate 2 times if remainder is 180
-    else if (angle%360 == 180) {new_image = process_4(process_4(image));}
-    //take the angle and divide it by 360 to get the remainder, rotate 3 times if remainder is 270
-    else {new_image = process_4(process_4(process_4(image)));}
-    return new_image;
+/**
+ * Computes a golden output of a pixel-local effect with the planar kernels,
+ * which must give the same image
+ * @param output the name of the output
+ * @param image  the input image
+ * @return the output image, empty if the effect is not pixel-local
+ */
+Image golden_planar_output(string output, const Image& image)
+{
+    int number = output.compare(0, 8, "process_") == 0 ? atoi(output.c_str() + 8) : 0;
+    if (!is_point_effect(number) || image.channels != 3)
+    {
+        return {};
+    }
+    PlanarImage planar = to_planar(image);
+    apply_pipeline(planar, {{number, number == 2 ? 0.3 : 0.5}});
+    return to_interleaved(planar);
 }
 
-//PROCESS 6 - Enlarges in the x and y direction
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+/**
+ * Reads the megapixels per second of each benchmark in a JSON report
+ * written by --benchmark
+ * Helper function for run_verify()
+ * @param filename the report
+ * @param speeds   the throughput of each benchmark, by name and image
+ * @return true if the report could be read
+ */
+bool read_benchmark_report(string filename, map<string, double>& speeds)
 {
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    int new_row = num_rows * y_scale; //Gets the new height
-    int new_col = num_columns * x_scale; //Gets the new width
-    vector<vector<Pixel>> new_image(new_row, vector<Pixel> (new_col)); //define a new 2D vector with the Pixel values and set it to have new size based on x_scale and y_scale
-    for (int row = 0; row < new_row; row++)
+    fstream stream;
+    stream.open(filename, ios::in);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    // Gets the text after a key on a line of the report
+    auto value = [](const string& line, string key) -> string
     {
-        for (int col = 0; col < new_col; col++)
+        size_t pos = line.find("\"" + key + "\": ");
+        if (pos == string::npos)
         {
-            //For each new pixel in new canvas, it takes on the corresponding pixel of the original image scaled back by x and y
-            int factor_row = row/y_scale;
-            int factor_col = col/x_scale;
-            new_image[row][col] = image[factor_row][factor_col];
+            return "";
+        }
+        pos += key.size() + 4;
+        // Strings are returned without their quotes
+        if (line[pos] == '"')
+        {
+            return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+        }
+        return line.substr(pos, line.find_first_of(",}", pos) - pos);
+    };
+    string line;
+    while (getline(stream, line))
+    {
+        string name = value(line, "benchmark");
+        string speed = value(line, "megapixels_per_second");
+        if (!name.empty() && !speed.empty())
+        {
+            speeds[name + " " + value(line, "image")] = atof(speed.c_str());
         }
     }
-    return new_image;
+    return !speeds.empty();
 }
 
-//PROCESS 7 - Converts image to high contrast - black and white only
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image) 
+/**
+ * Regression check. Runs every effect and a few pipelines on the bundled
+ * sample and on generated images, one of them with an alpha channel and one
+ * big enough for several bands, with one and with several threads, checks
+ * that top-down files decode to the same images, and compares the outputs
+ * with the golden hashes. With a baseline report from --benchmark,
+ * it also runs the benchmarks and fails any that lost more than the
+ * tolerance of their throughput.
+ * @param baseline  JSON report to compare the throughput with, none if empty
+ * @param tolerance largest allowed loss of throughput, in percent
+ * @return the program exit code
+ */
+int run_verify(string baseline, double tolerance)
 {
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
+    map<string, Image> images;
+    images["sample2.bmp"] = read_image("sample2.bmp");
+    images["257x131"] = make_test_image(257, 131);
+    images["300x200 noise"] = make_noise_image(300, 200);
+    images["1200x800 noise"] = make_noise_image(1200, 800);
+    images["300x200 noise alpha"] = make_alpha_image(300, 200);
+
+    int failures = 0;
+    int checks = 0;
+    // The outputs must not depend on how the rows are split among threads
+    int default_threads = get_thread_pool()->size();
+    for (int threads : {1, 3, default_threads})
     {
-        for (int col = 0; col < num_columns; col++)
+        set_thread_count(threads);
+        for (const GoldenHash& golden : GOLDEN_HASHES)
         {
-            //What are the red, blue and green values for current cell? Obtain the info and calculate the average (gray value)
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-            double gray_value = (red_value + green_value + blue_value)/3;
-            if (gray_value >= (255/2))
+            unsigned long long hash = image_hash(golden_output(golden.output, images[golden.image]));
+            checks++;
+            if (hash != golden.hash)
             {
-            //If the cell is light, make it white & save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
+                failures++;
+                cout << "FAIL " << golden.output << " on " << golden.image << " with " << threads
+                     << " threads: hash " << hex << hash << ", expected " << golden.hash << dec << endl;
             }
-            //If the cell is dark, make it black & save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-            else
+            Image planar = golden_planar_output(golden.output, images[golden.image]);
+            if (!planar.empty())
             {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
+                checks++;
+                if (image_hash(planar) != golden.hash)
+                {
+                    failures++;
+                    cout << "FAIL planar " << golden.output << " on " << golden.image << " with " << threads << " threads" << endl;
+                }
             }
         }
     }
-    return new_image;
-}
+    set_thread_count(default_threads);
+    cout << checks - failures << " of " << checks << " outputs match the golden images" << endl;
 
-//PROCESS 8 - Lightens image
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor) 
-{
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
+    if (!baseline.empty())
     {
-        for (int col = 0; col < num_columns; col++)
+        map<string, double> expected;
+        if (!read_benchmark_report(baseline, expected))
+        {
+            cout << "Could not read the baseline report " << baseline << endl;
+            return 1;
+        }
+        vector<BenchmarkResult> results;
+        if (!run_benchmarks(results))
+        {
+            return 1;
+        }
+        int slower = 0;
+        for (const BenchmarkResult& result : results)
         {
-            //What are the red, blue and green values for current cell?
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-            //Calculate the new red, green and blue values based on scaling factor 
-            int new_red = 255 - (255 - red_value)* scaling_factor;
-            int new_green = 255 - (255 - green_value)* scaling_factor;
-            int new_blue = 255 - (255 - blue_value)* scaling_factor;
-            //and assign those to the corresponding pixel located at this row and column in the new 2D vector
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+            auto found = expected.find(result.name + " " + result.image);
+            if (found == expected.end())
+            {
+                continue;
+            }
+            double speed = (double)result.width * result.height / 1e6 / result.best;
+            if (speed < found->second * (1 - tolerance / 100))
+            {
+                slower++;
+                cout << "SLOWER " << result.name << " on " << result.image << ": " << speed
+                     << " MP/s, baseline " << found->second << " MP/s" << endl;
+            }
         }
+        cout << slower << " benchmarks lost more than " << tolerance << "% of their baseline throughput" << endl;
+        failures += slower;
     }
-    return new_image;
+    return failures > 0 ? 1 : 0;
 }
 
-//PROCESS 9 - Darkens image
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor) 
+// Image of an interactive session, decoded once and edited by each effect
+struct Session
+{
+    // The file the image was decoded from
+    string file_name;
+    // Modification time and size of the file when it was decoded
+    struct timespec modified = {0, 0};
+    off_t size = -1;
+    // Result of the effects applied so far
+    Image image;
+};
+
+/**
+ * Gets the current image of an interactive session. The file is decoded on
+ * first use, and decoded again when another file is chosen or when the
+ * file's modification time or size changes, which discards the effects
+ * applied so far.
+ * @param session   the session
+ * @param file_name the input BMP filename
+ * @return the current image, empty if the file is not a valid image
+ */
+Image session_image(Session& session, string file_name)
 {
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
+    struct stat info;
+    if (stat(file_name.c_str(), &info) != 0)
     {
-        for (int col = 0; col < num_columns; col++)
+        session = Session();
+        return {};
+    }
+    bool changed = info.st_mtim.tv_sec != session.modified.tv_sec
+        || info.st_mtim.tv_nsec != session.modified.tv_nsec || info.st_size != session.size;
+    if (session.image.empty() || file_name != session.file_name || changed)
+    {
+        if (!session.image.empty() && file_name == session.file_name)
         {
-            //What are the red, blue and green values for current cell?
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-            //Calculate the new red, green and blue values based on scaling factor - multiply current value by a scaling factor less than 1 to make the color darker
-            int new_red = red_value * scaling_factor;
-            int new_green = green_value * scaling_factor;
-            int new_blue = blue_value * scaling_factor;
-            //and assign those to the corresponding pixel located at this row and column in the new 2D vector
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+            cout << "The input file changed, reloading it" << endl;
         }
+        // The file is read into memory rather than mapped, so that the
+        // session keeps its pixels even if the file is overwritten
+        session.file_name = file_name;
+        session.modified = info.st_mtim;
+        session.size = info.st_size;
+        session.image = read_image(file_name);
     }
-    return new_image;
+    return session.image;
 }
 
-//PROCESS 10 - Converts to only black, white, red, blue and green
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
-{
-    int num_rows = image.size(); //Gets the number of rows (i.e. height) in a 2D vector named image
-    int num_columns = image[0].size(); //Gets the number of columns (i.e. width) in a 2D vector named image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns)); //define a new 2D vector with the Pixel values and set it to have the same rows and columns as the original image. 
-    for (int row = 0; row < num_rows; row++)
-    {
-        for (int col = 0; col < num_columns; col++)
-        {
-            //What are the red, blue and green values for current cell? Obtain the info and calculate the max value
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-            //If the cell is light, make it white
-            if (red_value + green_value + blue_value >= 550)
-            {
-                int new_red = 255;
-                int new_green = 255;
-                int new_blue = 255;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-            //If the cell is dark, make it black
-            else if (red_value + green_value + blue_value < 150)
-            {
-                int new_red = 0;
-                int new_green = 0;
-                int new_blue = 0;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-            //If the red value is highest, set it to max of 255 and set the other two colours to 0
-            else if (red_value > green_value && red_value > blue_value)
-            {
-                int new_red = 255;
-                int new_green = 0;
-                int new_blue = 0;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-            //If the green value is highest, set it to max of 255 and set the other two colours to 0
-            else if (green_value > red_value && green_value > blue_value)
-            {
-                int new_red = 0;
-                int new_green = 255;
-                int new_blue = 0;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-            else
-            {
-                int new_red = 0;
-                int new_green = 0;
-                int new_blue = 255;
-                //Save the new color values to the corresponding pixel located at this row and column in the new 2D vector
-                new_image[row][col].red = new_red;
-                new_image[row][col].green = new_green;
-                new_image[row][col].blue = new_blue;
-            }
-        }
+/**
+ * Makes the result of an effect the current image of a session, so the
+ * next effect applies to it
+ * @param session the session
+ * @param result  the result of the effect, ignored if empty
+ */
+void update_session(Session& session, const Image& result)
+{
+    if (!result.empty())
+    {
+        session.image = result;
     }
-    return new_image;
 }
-    
-int main()
+
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && (string(argv[1]) == "--benchmark" || string(argv[1]) == "--verify"))
+    {
+        ToolOptions options;
+        if (!parse_tool_arguments(argc, argv, options))
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (string(argv[1]) == "--benchmark")
+        {
+            return run_benchmark(options.output);
+        }
+        return run_verify(options.baseline, options.tolerance);
+    }
+    if (argc > 1)
+    {
+        return run_command_line(argc, argv);
+    }
+
     string file_name;
     cout <<""<<endl;
     cout <<"CSPB 1300 Image Processing Application"<<endl;
     cout <<""<<endl;
     cout <<"Enter input BMP filename: ";
     cin>> file_name;
+    Session session;
     int input;
     cout <<""<<endl;
     cout <<"IMAGE PROCESSING MENU"<<endl;
@@ -558,6 +5017,8 @@ int main()
             cout <<"Enter input BMP filename: ";
             cin>> change_to;
             file_name = change_to;
+            // Choosing a file, even the same one again, discards the edits
+            session = Session();
             cout <<"Successfully changed input image!"<<endl; 
         }
         else if (input == 1)
@@ -573,9 +5034,15 @@ int main()
             cout <<"Enter output BMP filename: ";
             string output_name;
             cin >> output_name; 
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_1 = process_1(test_image);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_1 = process_1(test_image);
             bool success_1 = write_image(output_name, test_image_1);
+            update_session(session, test_image_1);
             cout <<"Successfully applied vignette!"<<endl;
         }
         else if (input == 2)
@@ -593,9 +5060,15 @@ int main()
             cout <<"Enter scaling factor: ";
             double scaling_factor;
             cin >> scaling_factor;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_2 = process_2(test_image,scaling_factor);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_2 = process_2(test_image,scaling_factor);
             bool success_2 = write_image(output_name, test_image_2);
+            update_session(session, test_image_2);
             cout <<"Successfully applied clarendon!"<<endl;
         }
         else if (input == 3)
@@ -610,9 +5083,15 @@ int main()
             cout <<"Enter output BMP filename: ";
             string output_name;
             cin >> output_name;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_3 = process_3(test_image);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_3 = process_3(test_image);
             bool success_3 = write_image(output_name, test_image_3);
+            update_session(session, test_image_3);
             cout <<"Successfully applied grayscale!"<<endl;       
         }
         else if (input == 4)
@@ -627,9 +5106,15 @@ int main()
             cout <<"Enter output BMP filename: ";
             string output_name;
             cin >> output_name;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_4 = process_4(test_image);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_4 = process_4(test_image);
             bool success_4 = write_image(output_name, test_image_4);
+            update_session(session, test_image_4);
             cout <<"Successfully applied 90 degree rotation!"<<endl;     
         }
         else if (input == 5)
@@ -647,9 +5132,15 @@ int main()
             cout <<"Enter number of 90-degree rotations: ";
             int number_of_rotations;
             cin >> number_of_rotations;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_5 = process_5(test_image,number_of_rotations);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_5 = process_5(test_image,number_of_rotations);
             bool success_5 = write_image(output_name, test_image_5);
+            update_session(session, test_image_5);
             cout <<"Successfully applied multiple 90-degree rotations!"<<endl;     
         }
         else if (input == 6)
@@ -670,9 +5161,15 @@ int main()
             cout <<"Enter number Y scale: ";
             int Y_value ;
             cin >> Y_value;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_6 = process_6(test_image,X_value,Y_value);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_6 = process_6(test_image,X_value,Y_value);
             bool success_6 = write_image(output_name, test_image_6);
+            update_session(session, test_image_6);
             cout <<"Successfully enlarged!"<<endl;     
         }
         else if (input == 7)
@@ -687,9 +5184,15 @@ int main()
             cout <<"Enter output BMP filename: ";
             string output_name;
             cin >> output_name;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_7 = process_7(test_image);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_7 = process_7(test_image);
             bool success_7 = write_image(output_name, test_image_7);
+            update_session(session, test_image_7);
             cout <<"Successfully applied high contrast!"<<endl;     
         }
         else if (input == 8)
@@ -707,9 +5210,15 @@ int main()
             cout <<"Enter scaling factor: ";
             double scaling_factor;
             cin >> scaling_factor;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_8 = process_8(test_image,scaling_factor);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_8 = process_8(test_image,scaling_factor);
             bool success_8 = write_image(output_name, test_image_8);
+            update_session(session, test_image_8);
             cout <<"Successfully lightened!"<<endl;     
         }
         else if (input == 9)
@@ -727,9 +5236,15 @@ int main()
             cout <<"Enter scaling factor: ";
             double scaling_factor;
             cin >> scaling_factor;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_9 = process_9(test_image,scaling_factor);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_9 = process_9(test_image,scaling_factor);
             bool success_9 = write_image(output_name, test_image_9);
+            update_session(session, test_image_9);
             cout <<"Successfully darkened!"<<endl;     
         }
         else if (input == 10)
@@ -744,9 +5259,15 @@ int main()
             cout <<"Enter output BMP filename: ";
             string output_name;
             cin >> output_name;
-            vector<vector<Pixel>> test_image = read_image(file_name);
-            vector<vector<Pixel>> test_image_10 = process_10(test_image);
+            Image test_image = session_image(session, file_name);
+            if (test_image.empty())
+            {
+                cout<<"Could not read "<<file_name<<", please use option 0 to update"<<endl;
+                continue;
+            }
+            Image test_image_10 = process_10(test_image);
             bool success_10 = write_image(output_name, test_image_10);
+            update_session(session, test_image_10);
             cout <<"Successfully applied black, white, red, green, blue filter!"<<endl;     
         }
         else if (input != 0 && input!=1 && input!=2 && input!=3 && input!=4 && input!=5 && input!=6 && input!=7 && input!=8 && input!=9 && input!=10)